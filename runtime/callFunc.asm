@@ -1,5 +1,5 @@
 
-    extern malloc
+    extern __GC_new_env
     extern __GC_malloc_wrapped
     extern __GC_realloc_wrapped
     extern __GC_mellow_add_alloc_wrapped
@@ -55,16 +55,34 @@ __mellow_use_main_stack:
     ; extern void* __GC_malloc(uint64_t alloc_size, GC_Env* gc_env)
     ; which calls
     ; __GC_malloc_wrapped(
-    ;     uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot
+    ;     uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot,
+    ;     void** rbp
     ; )
     global __GC_malloc
 __GC_malloc:
+    ; Spill the callee-saved registers (GC_SAVED_REGISTERS of them) onto the
+    ; green thread stack, where the collector can see any references the caller
+    ; keeps in them. A compacting collection never moves what they point to
+    push    rbx
+    push    rbp
+    push    r12
+    push    r13
+    push    r14
+    push    r15
     mov     rdx, rsp
     ; Get curThread pointer
     mov     rcx, qword [currentthread]
     mov     rcx, qword [rcx+16]   ; ThreadData->t_StackBot
+    ; The frame of the caller, where the stack walk starts
+    mov     r8, rbp
     mov     r10, __GC_malloc_wrapped
     call    __mellow_use_main_stack
+    pop     r15
+    pop     r14
+    pop     r13
+    pop     r12
+    pop     rbp
+    pop     rbx
     ret
 
     ; extern void* __GC_realloc(uint64_t alloc_size, GC_Env* gc_env)
@@ -147,19 +165,12 @@ callFunc:
     mov     qword [rcx+8], r11  ; ThreadData->curFuncAddr, init to start of func
 
     ; Use the gcEnv field (which shares space in an anonymous union with
-    ; funcAddr, which we no longer need to store) to malloc a new GC_Env object
+    ; funcAddr, which we no longer need to store) to hold a new, zeroed GC_Env
+    ; object
     push    rcx
-    mov     rdi, 48             ; sizeof(GC_Env)
-    call    malloc
+    call    __GC_new_env
     pop     rcx
 
-    ; Initialize the new GC_Env object
-    mov     qword [rax], 0      ; Set GC_Env->allocs to NULL
-    mov     qword [rax+8], 0    ; Set GC_Env->allocs_len to 0
-    mov     qword [rax+16], 0   ; Set GC_Env->allocs_end to 0
-    mov     qword [rax+24], 0   ; Set GC_Env->ptr_hashset_t to 0
-    mov     qword [rax+32], 0   ; Set GC_Env->last_collection to 0
-    mov     qword [rax+40], 0   ; Set GC_Env->total_alloced to 0
     ; Set ThreadData->gcEnv to the new GC_Env object
     mov     qword [rcx], rax
 
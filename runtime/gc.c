@@ -1,21 +1,491 @@
+#define _GNU_SOURCE
 
 #include <assert.h>
+#include <inttypes.h> // So we can printf uint_t types
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h> // for sysconf
 #include "gc.h"
 #include "ptr_hashset.h"
 
 #ifdef GC_DEBUG
 
-#include <pthread.h>
-
 static pthread_mutex_t gc_debug_mutex = PTHREAD_MUTEX_INITIALIZER;
 uint64_t __mellow_debug_total_gc_collections = 0;
+uint64_t __mellow_debug_gc_pause_histogram[GC_PAUSE_HISTOGRAM_BUCKETS];
+
+#endif
+
+#ifdef MULTITHREAD
+
+// A dead list handed off to the background sweepers. Ownership of dead, and of
+// every allocation in dead[start, len), passes to the sweeper pool
+typedef struct GC_Sweep_Batch {
+    Allocation* dead;
+    uint64_t start;
+    uint64_t len;
+    struct GC_Sweep_Batch* next;
+} GC_Sweep_Batch;
+
+static pthread_mutex_t sweeper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweeper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sweeper_threads[GC_SWEEPER_THREADS];
+static uint64_t sweepers_running = 0;
+static uint64_t sweepers_done = 0;
+static GC_Sweep_Batch* sweep_queue_head = NULL;
+static GC_Sweep_Batch* sweep_queue_tail = NULL;
 
 #endif
 
+// Process-wide pacing defaults, copied into each new GC_Env
+static uint64_t default_growth_percent = GC_DEFAULT_GROWTH_PERCENT;
+static uint64_t default_min_heap = GC_DEFAULT_MIN_HEAP;
+static uint64_t default_soft_limit = 0;
+static uint64_t default_compact_percent = GC_DEFAULT_COMPACT_PERCENT;
+
+// Total GC'd memory across every GC_Env in the process, checked against the
+// soft limit. Updated atomically, as GC_Envs in the multithreaded runtime
+// allocate and collect concurrently
+static uint64_t gc_heap_total = 0;
+
+// Telemetry of every GC_Env torn down so far, folded together
+static pthread_mutex_t gc_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GC_Stats process_stats;
+static uint64_t process_green_threads = 0;
+// Time the background sweepers of the multithreaded runtime have spent
+// freeing, which can't be attributed to a GC_Env that may no longer exist
+static uint64_t background_sweep_ns = 0;
+
+// Where a heap profile is written after every collection, if
+// MELLOW_HEAP_PROFILE is set
+static pthread_mutex_t heap_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE* heap_profile_out = NULL;
+
+static uint64_t __GC_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Parse a byte count with an optional K, M, or G suffix. Returns 0 if the
+// string is not a valid byte count
+static uint64_t __GC_parse_bytes(const char* str)
+{
+    char* end;
+    uint64_t val = strtoull(str, &end, 10);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        val <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        val <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        val <<= 30;
+        end++;
+        break;
+    }
+    if (end == str || *end != '\0')
+    {
+        return 0;
+    }
+    return val;
+}
+
+// Read the pacing defaults from the environment. Must be called before any
+// GC_Env is created
+void __GC_init_pacing()
+{
+    const char* growth = getenv("MELLOW_GC_GROWTH");
+    if (growth != NULL)
+    {
+        if (strcmp(growth, "off") == 0)
+        {
+            default_growth_percent = GC_GROWTH_OFF;
+        }
+        else
+        {
+            char* end;
+            uint64_t percent = strtoull(growth, &end, 10);
+            if (end != growth && *end == '\0')
+            {
+                default_growth_percent = percent;
+            }
+        }
+    }
+    const char* min_heap = getenv("MELLOW_GC_MIN_HEAP");
+    if (min_heap != NULL)
+    {
+        default_min_heap = __GC_parse_bytes(min_heap);
+    }
+    const char* soft_limit = getenv("MELLOW_GC_SOFT_LIMIT");
+    if (soft_limit != NULL)
+    {
+        default_soft_limit = __GC_parse_bytes(soft_limit);
+    }
+    const char* compact = getenv("MELLOW_GC_COMPACT");
+    if (compact != NULL)
+    {
+        if (strcmp(compact, "off") == 0)
+        {
+            default_compact_percent = 0;
+        }
+        else
+        {
+            char* end;
+            uint64_t percent = strtoull(compact, &end, 10);
+            if (end != compact && *end == '\0' && percent <= 100)
+            {
+                default_compact_percent = percent;
+            }
+        }
+    }
+}
+
+GC_Env* __GC_new_env()
+{
+    GC_Env* gc_env = (GC_Env*)calloc(1, sizeof(GC_Env));
+    gc_env->growth_percent = default_growth_percent;
+    gc_env->min_heap = default_min_heap;
+    gc_env->soft_limit = default_soft_limit;
+    gc_env->compact_percent = default_compact_percent;
+    return gc_env;
+}
+
+uint64_t __GC_heap_total()
+{
+    return __atomic_load_n(&gc_heap_total, __ATOMIC_RELAXED);
+}
+
+// The value of total_allocated past which the next collection is triggered
+static uint64_t __GC_collection_goal(GC_Env* gc_env)
+{
+    uint64_t headroom;
+    if (gc_env->growth_percent == GC_GROWTH_OFF)
+    {
+        headroom = UINT64_MAX - gc_env->last_collection;
+    }
+    else
+    {
+        headroom = gc_env->last_collection / 100 * gc_env->growth_percent
+                 + gc_env->last_collection % 100 * gc_env->growth_percent / 100;
+    }
+    uint64_t goal = gc_env->last_collection + headroom;
+    if (goal < gc_env->min_heap)
+    {
+        goal = gc_env->min_heap;
+    }
+
+    // Never plan to grow past what is left under the soft limit, down to a
+    // minimum headroom so that an entirely live heap doesn't thrash
+    if (gc_env->soft_limit != 0)
+    {
+        uint64_t heap_total = __GC_heap_total();
+        uint64_t room = heap_total < gc_env->soft_limit
+                      ? gc_env->soft_limit - heap_total
+                      : 0;
+        uint64_t limited = gc_env->total_allocated + room;
+        uint64_t normal_headroom = gc_env->growth_percent == GC_GROWTH_OFF
+                                 ? gc_env->min_heap
+                                 : goal - gc_env->last_collection;
+        uint64_t floor = gc_env->last_collection
+                       + normal_headroom / GC_SOFT_LIMIT_MIN_HEADROOM_DIVISOR;
+        if (limited < floor)
+        {
+            limited = floor;
+        }
+        if (limited < goal)
+        {
+            goal = limited;
+        }
+    }
+
+    return goal;
+}
+
+static uint64_t __GC_large_mapping_size(uint64_t size)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+// Header at the start of every arena chunk. Allocations start at
+// GC_ARENA_CHUNK_HEADER, so that they stay 16-byte aligned
+typedef struct GC_Arena_Chunk {
+    // GC_Env that carves allocations out of this chunk, or NULL once it has been
+    // torn down
+    GC_Env* owner;
+    // Number of holds keeping the chunk from being released: one for its owner
+    // until it is torn down, and one for each of its allocations tracked by
+    // another GC_Env, or in flight to one over a channel. Only ever updated
+    // atomically, so sending and receiving never wait on each other
+    uint64_t holders;
+    struct GC_Arena_Chunk* next;
+} GC_Arena_Chunk;
+
+#define GC_ARENA_CHUNK_HEADER 32
+
+// Chunks nobody holds anymore, waiting to be reused. Only the pool itself is
+// guarded by arena_mutex
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GC_Arena_Chunk* chunk_pool = NULL;
+static uint64_t chunk_pool_len = 0;
+
+static GC_Arena_Chunk* __GC_chunk_of(void* ptr)
+{
+    return (GC_Arena_Chunk*)((uint64_t)ptr & ~(uint64_t)(GC_ARENA_CHUNK_SIZE - 1));
+}
+
+static GC_Env* __GC_chunk_owner(GC_Arena_Chunk* chunk)
+{
+    return __atomic_load_n(&chunk->owner, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t __GC_arena_class(uint64_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    return (size - 1) / GC_ARENA_CLASS_SIZE;
+}
+
+// Whether alloc was carved out of one of gc_env's own chunks, and so is
+// released along with them when gc_env is torn down
+static uint64_t __GC_is_pooled(Allocation alloc, GC_Env* gc_env)
+{
+    return alloc.arena && __GC_chunk_owner(__GC_chunk_of(alloc.ptr)) == gc_env;
+}
+
+// Put a chunk nobody holds allocations in anymore back in the pool, or free it
+// if the pool is full. arena_mutex must be held
+static void __GC_arena_release_chunk(GC_Arena_Chunk* chunk)
+{
+    if (chunk_pool_len < GC_ARENA_POOL_CHUNKS)
+    {
+        chunk->next = chunk_pool;
+        chunk_pool = chunk;
+        chunk_pool_len++;
+    }
+    else
+    {
+        free(chunk);
+    }
+}
+
+// Start carving allocations out of a fresh chunk, from the pool if it has one.
+// Returns 0 if no chunk could be had
+static uint64_t __GC_arena_new_chunk(GC_Env* gc_env)
+{
+    pthread_mutex_lock(&arena_mutex);
+    GC_Arena_Chunk* chunk = chunk_pool;
+    if (chunk != NULL)
+    {
+        chunk_pool = chunk->next;
+        chunk_pool_len--;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+
+    if (chunk == NULL)
+    {
+        void* mem;
+        if (posix_memalign(&mem, GC_ARENA_CHUNK_SIZE, GC_ARENA_CHUNK_SIZE) != 0)
+        {
+            return 0;
+        }
+        chunk = (GC_Arena_Chunk*)mem;
+    }
+    chunk->owner = gc_env;
+    chunk->holders = 1;
+    chunk->next = gc_env->chunks;
+    gc_env->chunks = chunk;
+    gc_env->arena_next = (char*)chunk + GC_ARENA_CHUNK_HEADER;
+    gc_env->arena_end = (char*)chunk + GC_ARENA_CHUNK_SIZE;
+    return 1;
+}
+
+// Get zeroed memory for a small allocation from gc_env's chunks, reusing a
+// free slot of its size class if there is one. Returns NULL if no chunk could
+// be had
+static void* __GC_arena_alloc(uint64_t size, GC_Env* gc_env)
+{
+    uint64_t size_class = __GC_arena_class(size);
+    uint64_t class_size = (size_class + 1) * GC_ARENA_CLASS_SIZE;
+    void* ptr = gc_env->arena_free[size_class];
+    if (ptr != NULL)
+    {
+        gc_env->arena_free[size_class] = *(void**)ptr;
+    }
+    else
+    {
+        // Whatever is left at the end of the current chunk is abandoned
+        if ((uint64_t)(gc_env->arena_end - gc_env->arena_next) < class_size)
+        {
+            if (!__GC_arena_new_chunk(gc_env))
+            {
+                return NULL;
+            }
+        }
+        ptr = gc_env->arena_next;
+        gc_env->arena_next += class_size;
+    }
+    // Slots are reused, and pooled chunks are not cleared
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+// Drop a hold on chunk, releasing it if that was the last one
+static void __GC_arena_drop(GC_Arena_Chunk* chunk)
+{
+    if (__atomic_sub_fetch(&chunk->holders, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&arena_mutex);
+        __GC_arena_release_chunk(chunk);
+        pthread_mutex_unlock(&arena_mutex);
+    }
+}
+
+// Note that alloc is leaving from for another GC_Env. If it was carved out of
+// one of from's own chunks, the chunk is held until whoever ends up with the
+// allocation drops it
+static void __GC_arena_export(Allocation alloc, GC_Env* from)
+{
+    if (!alloc.arena)
+    {
+        return;
+    }
+    GC_Arena_Chunk* chunk = __GC_chunk_of(alloc.ptr);
+    if (__GC_chunk_owner(chunk) == from)
+    {
+        __atomic_add_fetch(&chunk->holders, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Note that alloc has arrived in to. If it was carved out of one of to's own
+// chunks, it is back home, and its hold on the chunk is dropped. to holds the
+// chunk itself, so this is never the last hold
+static void __GC_arena_import(Allocation alloc, GC_Env* to)
+{
+    if (!alloc.arena)
+    {
+        return;
+    }
+    GC_Arena_Chunk* chunk = __GC_chunk_of(alloc.ptr);
+    if (__GC_chunk_owner(chunk) == to)
+    {
+        __atomic_sub_fetch(&chunk->holders, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Drop gc_env's hold on each of its chunks. Chunks still holding allocations
+// tracked by other GC_Envs, or in flight to them, are orphaned instead of
+// released, and released by whoever drops the last of them
+static void __GC_arena_release_all(GC_Env* gc_env)
+{
+    GC_Arena_Chunk* chunk = gc_env->chunks;
+    while (chunk != NULL)
+    {
+        GC_Arena_Chunk* next = chunk->next;
+        __atomic_store_n(&chunk->owner, NULL, __ATOMIC_RELEASE);
+        __GC_arena_drop(chunk);
+        chunk = next;
+    }
+
+    gc_env->chunks = NULL;
+    gc_env->arena_next = NULL;
+    gc_env->arena_end = NULL;
+    memset(gc_env->arena_free, 0, sizeof(gc_env->arena_free));
+}
+
+// Get zeroed memory for a new GC allocation in gc_env: from its arena chunks if
+// it is small, or from the large-object space if it is big enough
+static Allocation __GC_alloc_block(uint64_t size, GC_Env* gc_env)
+{
+    Allocation alloc = { .ptr = NULL, .size = size };
+    if (size <= GC_ARENA_MAX_OBJECT)
+    {
+        alloc.ptr = __GC_arena_alloc(size, gc_env);
+        if (alloc.ptr != NULL)
+        {
+            alloc.arena = 1;
+            return alloc;
+        }
+    }
+    if (size >= GC_LARGE_OBJECT_THRESHOLD)
+    {
+        void* ptr = mmap(
+            NULL, __GC_large_mapping_size(size), PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0
+        );
+        if (ptr != MAP_FAILED)
+        {
+            alloc.ptr = ptr;
+            alloc.large = 1;
+            return alloc;
+        }
+    }
+    alloc.ptr = calloc(size, 1);
+    return alloc;
+}
+
+// Return the memory of a GC allocation that is not in an arena chunk to
+// wherever it came from
+static void __GC_release_block(Allocation alloc)
+{
+    if (alloc.large)
+    {
+        munmap(alloc.ptr, __GC_large_mapping_size(alloc.size));
+    }
+    else
+    {
+        free(alloc.ptr);
+    }
+}
+
+// Return the memory of an allocation that gc_env has stopped tracking. Slots in
+// gc_env's own chunks go back to their size class for reuse
+static void __GC_release_alloc(Allocation alloc, GC_Env* gc_env)
+{
+    if (!alloc.arena)
+    {
+        __GC_release_block(alloc);
+        return;
+    }
+    GC_Arena_Chunk* chunk = __GC_chunk_of(alloc.ptr);
+    if (__GC_chunk_owner(chunk) != gc_env)
+    {
+        __GC_arena_drop(chunk);
+        return;
+    }
+    uint64_t size_class = __GC_arena_class(alloc.size);
+    *(void**)alloc.ptr = gc_env->arena_free[size_class];
+    gc_env->arena_free[size_class] = alloc.ptr;
+}
+
+static void __GC_add_alloc(Allocation alloc, GC_Env* gc_env);
+static void __GC_mark_stack_range(void** from, void** to, GC_Env* gc_env);
+
+// Claim memory that was malloc'd outside of the GC
 void __GC_mellow_add_alloc_wrapped(void* ptr, uint64_t size, GC_Env* gc_env)
+{
+    Allocation alloc = { .ptr = ptr, .size = size };
+    __GC_add_alloc(alloc, gc_env);
+}
+
+// Start tracking alloc in gc_env. Only gc_env's own accounting is updated
+static void __GC_insert_alloc(Allocation alloc, GC_Env* gc_env)
 {
     if (gc_env->allocs == NULL)
     {
@@ -51,12 +521,48 @@ void __GC_mellow_add_alloc_wrapped(void* ptr, uint64_t size, GC_Env* gc_env)
         );
         init_ptr_hashset(gc_env->allocs_hashset, 32768);
     }
-    add_key(gc_env->allocs_hashset, ptr);
+    alloc.node = add_key_node(gc_env->allocs_hashset, alloc.ptr);
+    alloc.node->value = gc_env->allocs_len;
 
-    gc_env->allocs[gc_env->allocs_len].ptr = ptr;
-    gc_env->allocs[gc_env->allocs_len].size = size;
+    gc_env->allocs[gc_env->allocs_len] = alloc;
     gc_env->allocs_len += 1;
-    gc_env->total_allocated += size;
+    gc_env->total_allocated += alloc.size;
+    if (!__GC_is_pooled(alloc, gc_env))
+    {
+        gc_env->unpooled_len++;
+    }
+}
+
+// Stop tracking the allocation whose hashset node is node, returning its
+// record. Only gc_env's own accounting is updated
+static Allocation __GC_unlink_alloc(key_node_t* node, GC_Env* gc_env)
+{
+    uint64_t index = node->value;
+    Allocation removed = gc_env->allocs[index];
+    remove_key(gc_env->allocs_hashset, removed.ptr);
+
+    // Fill the hole with the last allocation in the list. If this was the last
+    // one, this is a no-op
+    gc_env->allocs_len--;
+    if (index != gc_env->allocs_len)
+    {
+        gc_env->allocs[index] = gc_env->allocs[gc_env->allocs_len];
+        gc_env->allocs[index].node->value = index;
+    }
+
+    gc_env->total_allocated -= removed.size;
+    if (!__GC_is_pooled(removed, gc_env))
+    {
+        gc_env->unpooled_len--;
+    }
+    return removed;
+}
+
+static void __GC_add_alloc(Allocation alloc, GC_Env* gc_env)
+{
+    __GC_insert_alloc(alloc, gc_env);
+    gc_env->stats.bytes_allocated += alloc.size;
+    __atomic_add_fetch(&gc_heap_total, alloc.size, __ATOMIC_RELAXED);
 }
 
 // Use this version of the GC allocatior if you're in a context where you want
@@ -69,94 +575,585 @@ void __GC_mellow_add_alloc_wrapped(void* ptr, uint64_t size, GC_Env* gc_env)
 // scanning during collection.
 void* __GC_malloc_nocollect(uint64_t size, GC_Env* gc_env)
 {
-    void* ptr = calloc(size, 1);
-    __GC_mellow_add_alloc_wrapped(ptr, size, gc_env);
-    return ptr;
+    Allocation alloc = __GC_alloc_block(size, gc_env);
+    __GC_add_alloc(alloc, gc_env);
+    return alloc.ptr;
+}
+
+#ifdef GC_DEBUG
+
+static void __GC_debug_record_pause(uint64_t pause_ns)
+{
+    uint64_t pause_us = pause_ns / 1000;
+    uint64_t bucket = 0;
+    while (pause_us > 0 && bucket < GC_PAUSE_HISTOGRAM_BUCKETS - 1)
+    {
+        pause_us >>= 1;
+        bucket++;
+    }
+    pthread_mutex_lock(&gc_debug_mutex);
+    __mellow_debug_total_gc_collections++;
+    __mellow_debug_gc_pause_histogram[bucket]++;
+    pthread_mutex_unlock(&gc_debug_mutex);
+}
+
+void __GC_debug_print_pause_histogram()
+{
+    printf("GC pause histogram (microseconds):\n");
+    uint64_t i;
+    for (i = 0; i < GC_PAUSE_HISTOGRAM_BUCKETS; i++)
+    {
+        if (__mellow_debug_gc_pause_histogram[i] == 0)
+        {
+            continue;
+        }
+        // Bucket 0 holds pauses under 1us, bucket i holds [2^(i-1), 2^i)
+        printf(
+            "    [%" PRIu64 ", %" PRIu64 "): %" PRIu64 "\n",
+            i == 0 ? 0 : ((uint64_t)1 << (i - 1)),
+            (uint64_t)1 << i,
+            __mellow_debug_gc_pause_histogram[i]
+        );
+    }
 }
 
+#endif
+
 void* __GC_malloc_wrapped(
-    uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot
+    uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot, void** rbp
 ) {
-    if (gc_env->total_allocated > gc_env->last_collection * 2)
+    // rsp points at the callee-saved registers of the caller, which the stub
+    // pushed below its return address
+    void** saved_registers = rsp;
+    rsp += GC_SAVED_REGISTERS;
+
+    // If a previous collection left dead allocations unfree'd, free a bounded
+    // number of them now. The cost of returning memory to the system allocator
+    // is spread across allocations instead of landing in the collection pause
+    if (gc_env->dead_index < gc_env->dead_len)
     {
-#ifdef GC_DEBUG
-        pthread_mutex_lock(&gc_debug_mutex);
-        __mellow_debug_total_gc_collections++;
-        pthread_mutex_unlock(&gc_debug_mutex);
-#endif
-        __GC_mellow_mark_stack(rsp, stack_bot, gc_env);
+        uint64_t step_start = __GC_now_ns();
+        __GC_sweep_step(gc_env, GC_SWEEP_STEP);
+        gc_env->stats.sweep_ns += __GC_now_ns() - step_start;
+    }
+
+    if (gc_env->total_allocated > __GC_collection_goal(gc_env))
+    {
+        uint64_t pause_start = __GC_now_ns();
+        __GC_mark_stack_range(saved_registers, rsp, gc_env);
+        __GC_mellow_mark_stack(rsp, stack_bot, rbp, gc_env);
+        uint64_t mark_end = __GC_now_ns();
         __GC_sweep(gc_env);
-        __GC_clear_marks(gc_env);
+#ifdef MULTITHREAD
+        // The mutator returns to user code right after marking, and the
+        // sweeper pool frees the garbage on otherwise idle cores
+        __GC_hand_off_dead(gc_env);
+#endif
         gc_env->last_collection = gc_env->total_allocated;
+        uint64_t sweep_end = __GC_now_ns();
+        __GC_compact(gc_env, saved_registers, stack_bot);
+        uint64_t pause_end = __GC_now_ns();
+
+        gc_env->stats.collections++;
+        gc_env->stats.mark_ns += mark_end - pause_start;
+        gc_env->stats.sweep_ns += sweep_end - mark_end;
+        gc_env->stats.compact_ns += pause_end - sweep_end;
+        if (pause_end - pause_start > gc_env->stats.max_pause_ns)
+        {
+            gc_env->stats.max_pause_ns = pause_end - pause_start;
+        }
+#ifdef GC_DEBUG
+        __GC_debug_record_pause(pause_end - pause_start);
+#endif
+        // What survived the collection is exactly what is still tracked
+        if (heap_profile_out != NULL)
+        {
+            pthread_mutex_lock(&heap_profile_mutex);
+            __GC_write_heap_profile(heap_profile_out, gc_env);
+            fflush(heap_profile_out);
+            pthread_mutex_unlock(&heap_profile_mutex);
+        }
     }
 
-    void* ptr = calloc(size, 1);
-    __GC_mellow_add_alloc_wrapped(ptr, size, gc_env);
-    return ptr;
+    Allocation alloc = __GC_alloc_block(size, gc_env);
+    // The return address of the call to __GC_malloc
+    alloc.site = rsp[0];
+    __GC_add_alloc(alloc, gc_env);
+    return alloc.ptr;
 }
 
 void* __GC_realloc_wrapped(
     void* ptr, uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot
 ) {
-    __GC_remove_alloc(ptr, gc_env);
+    key_node_t* node = find_key(gc_env->allocs_hashset, ptr);
+    if (node == NULL)
+    {
+        assert(0);
+    }
+    Allocation* alloc = &gc_env->allocs[node->value];
+    Allocation old = *alloc;
+
+    // Arena slots have room up to the end of their size class, and both
+    // realloc and mremap grow the block in place when the memory after it is
+    // free. In those cases the allocation record is just resized
+    Allocation moved = old;
+    moved.size = size;
+    if (
+        old.arena && size <= GC_ARENA_MAX_OBJECT &&
+        __GC_arena_class(size) == __GC_arena_class(old.size)
+    ) {
+        // The slot already fits
+    }
+    else if (!old.arena && !old.large && size < GC_LARGE_OBJECT_THRESHOLD)
+    {
+        moved.ptr = realloc(ptr, size);
+    }
+    else if (
+        old.large && size >= GC_LARGE_OBJECT_THRESHOLD &&
+        (moved.ptr = mremap(
+            ptr, __GC_large_mapping_size(old.size),
+            __GC_large_mapping_size(size), MREMAP_MAYMOVE
+        )) != MAP_FAILED
+    ) {
+        // The kernel grew or shrank the mapping, moving it only if it had to
+    }
+    // Moving between size classes, or into or out of the arena or the
+    // large-object space
+    else
+    {
+        moved = __GC_alloc_block(size, gc_env);
+        memcpy(moved.ptr, ptr, old.size < size ? old.size : size);
+        __GC_release_alloc(old, gc_env);
+    }
+    void* new_ptr = moved.ptr;
 
-    void* new_ptr = realloc(ptr, size);
-    __GC_mellow_add_alloc_wrapped(new_ptr, size, gc_env);
+    if (new_ptr != ptr)
+    {
+        uint64_t index = node->value;
+        remove_key(gc_env->allocs_hashset, ptr);
+        node = add_key_node(gc_env->allocs_hashset, new_ptr);
+        node->value = index;
+    }
+    moved.node = node;
+    moved.owned = old.owned;
+    moved.site = old.site;
+    *alloc = moved;
+    gc_env->unpooled_len += !__GC_is_pooled(moved, gc_env);
+    gc_env->unpooled_len -= !__GC_is_pooled(old, gc_env);
+
+    gc_env->total_allocated += size - old.size;
+    if (size > old.size)
+    {
+        gc_env->stats.bytes_allocated += size - old.size;
+        __atomic_add_fetch(&gc_heap_total, size - old.size, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_sub_fetch(&gc_heap_total, old.size - size, __ATOMIC_RELAXED);
+    }
 
     return new_ptr;
 }
 
-void __GC_remove_alloc(void* ptr, GC_Env* gc_env)
+// Stop tracking ptr, returning its allocation record. The memory itself is
+// left alone
+Allocation __GC_remove_alloc(void* ptr, GC_Env* gc_env)
 {
-    if (!__GC_mellow_is_valid_ptr(ptr, gc_env))
+    key_node_t* node = find_key(gc_env->allocs_hashset, ptr);
+    if (node == NULL)
     {
         assert(0);
     }
-
-    // Minus 1 because if the ptr is the last ptr in the list, we're
-    // decrementing the length of the valid portion of the allocs array anyway
-    uint64_t index;
-    for (index = 0; index < gc_env->allocs_len - 1; index++)
-    {
-        if (gc_env->allocs[index].ptr == ptr)
-        {
-            gc_env->allocs[index] = gc_env->allocs[gc_env->allocs_len - 1];
-        }
-    }
-
-    gc_env->allocs_len--;
+    Allocation removed = __GC_unlink_alloc(node, gc_env);
+    __atomic_sub_fetch(&gc_heap_total, removed.size, __ATOMIC_RELAXED);
+    return removed;
 }
 
-void __GC_mellow_mark_stack(void** rsp, void** stack_bot, GC_Env* gc_env)
+// Get the allocation record for ptr, or NULL if ptr was not allocated by the
+// GC. The record may move on the next allocation or collection, so don't hold
+// on to it
+Allocation* __GC_find_alloc(void* ptr, GC_Env* gc_env)
 {
-    uint64_t index;
-    uint64_t indices = ((uint64_t)stack_bot - (uint64_t)rsp) / 8;
-    // Absolutely ensure we're 8-byte aligned
-    if ((uint64_t)rsp % 8 != 0) {
-        rsp = (void**)((uint64_t)rsp + (8 - ((uint64_t)rsp % 8)));
+    if (gc_env->allocs_hashset == NULL)
+    {
+        return NULL;
     }
-    for (index = 0; index < indices; index++)
+    key_node_t* node = find_key(gc_env->allocs_hashset, ptr);
+    if (node == NULL)
     {
-        void* ptr = rsp[index];
+        return NULL;
+    }
+    return &gc_env->allocs[node->value];
+}
 
-        // If the value is "small" or not eight-byte aligned, it's very, very
-        // likely not a real pointer, so skip it. Note that if this heuristic is
-        // wrong, this will cause a leak
-        if ((uint64_t)ptr < 1024 || ((uint64_t)ptr & 0b111) != 0)
-        {
-            continue;
-        }
+static void __GC_init_type_infos();
+static const uint32_t* __GC_layout_of(void* ptr, uint64_t size);
+static void __GC_for_each_ref(
+    void* ptr, uint64_t size, const uint32_t* layout,
+    void (*visit)(void*, void**), void* state
+);
 
-        if (__GC_mellow_is_valid_ptr(ptr, gc_env))
+// The allocation records of a value written to a channel, from when the
+// writer lets go of them until the reader takes them. Each write has its own,
+// carried in the channel along with the value, so they belong to neither side
+// in the meantime
+struct GC_Transfer {
+    Allocation* allocs;
+    uint64_t allocs_len;
+    uint64_t allocs_end;
+};
+
+typedef struct {
+    GC_Env* from;
+    GC_Transfer* transfer;
+    // Maps the address of each object copied to the address of its copy
+    ptr_hashset_t copies;
+} GC_Transfer_State;
+
+// Add alloc to the records handed over. Whether the sender's collector had
+// marked it is of no concern to the collector of the reader
+static void __GC_transfer_record(GC_Transfer_State* state, Allocation alloc)
+{
+    GC_Transfer* transfer = state->transfer;
+    if (transfer->allocs_len >= transfer->allocs_end)
+    {
+        transfer->allocs_end = transfer->allocs_end * 2 + 16;
+        transfer->allocs = realloc(
+            transfer->allocs, transfer->allocs_end * sizeof(Allocation)
+        );
+    }
+    ((uint64_t*)alloc.ptr)[1] &= 0x7FFFFFFFFFFFFFFF;
+    transfer->allocs[transfer->allocs_len++] = alloc;
+}
+
+// Copy the object at ptr for the reader, if from owns it and it hasn't been
+// copied yet, returning the address of its copy. Anything else, like a static
+// string, is shared as it is
+static void* __GC_transfer_copy(GC_Transfer_State* state, void* ptr)
+{
+    key_node_t* copied = find_key(&state->copies, ptr);
+    if (copied != NULL)
+    {
+        return (void*)copied->value;
+    }
+    Allocation* alloc = __GC_find_alloc(ptr, state->from);
+    if (alloc == NULL)
+    {
+        return ptr;
+    }
+    // The copy is exactly as big, spare capacity and all, but no ~= appends
+    // to it in place. It comes out of the sender's arena, which is what the
+    // sender is charged for, but only the reader ever tracks it
+    Allocation copy = __GC_alloc_block(alloc->size, state->from);
+    memcpy(copy.ptr, ptr, alloc->size);
+    state->from->stats.bytes_allocated += copy.size;
+    __atomic_add_fetch(&gc_heap_total, copy.size, __ATOMIC_RELAXED);
+    __GC_arena_export(copy, state->from);
+    add_key_node(&state->copies, ptr)->value = (uint64_t)copy.ptr;
+    __GC_transfer_record(state, copy);
+    return copy.ptr;
+}
+
+static void __GC_transfer_copy_ref(void* state, void** slot)
+{
+    if (*slot != NULL)
+    {
+        *slot = __GC_transfer_copy(state, *slot);
+    }
+}
+
+// Hand the record of the object in slot over as it is, if state->from owns it
+static void __GC_transfer_move_ref(void* arg, void** slot)
+{
+    GC_Transfer_State* state = arg;
+    if (*slot == NULL || state->from->allocs_hashset == NULL)
+    {
+        return;
+    }
+    key_node_t* node = find_key(state->from->allocs_hashset, *slot);
+    if (node == NULL)
+    {
+        return;
+    }
+    Allocation alloc = __GC_unlink_alloc(node, state->from);
+    __GC_arena_export(alloc, state->from);
+    __GC_transfer_record(state, alloc);
+}
+
+// Follow the references of every object handed over so far, and of those
+// they lead to in turn, handing each object they reach to visit. The
+// references are found through the precise layouts of the types, so nothing
+// that merely looks like a pointer is followed
+static void __GC_transfer_walk(
+    GC_Transfer_State* state, void (*visit)(void*, void**)
+) {
+    uint64_t i;
+    for (i = 0; i < state->transfer->allocs_len; i++)
+    {
+        // visit may grow the list, so don't hold on to the record
+        Allocation alloc = state->transfer->allocs[i];
+        const uint32_t* layout = __GC_layout_of(alloc.ptr, alloc.size);
+        if (layout != NULL)
         {
-            Marking_Func_Ptr mark_func_ptr = ((Marking_Func_Ptr*)(ptr))[0];
-            if (mark_func_ptr == 0)
+            __GC_for_each_ref(alloc.ptr, alloc.size, layout, visit, state);
+        }
+    }
+}
+
+// Called by the sender of a channel value, before it is written to the channel,
+// returning what to write instead, and setting *transfer to the records to
+// write along with it. Either way the reader gets a value that nothing else
+// references. If unique is set, the compiler has proven that nothing but the
+// value itself references anything in its object graph, so the records of the
+// part the sender owns are handed over as they are, and no bytes are copied.
+// Otherwise that part is copied, and the sender keeps everything it had,
+// shared substructure included. leaf is set if the caller knows ptr holds no
+// references
+void* __GC_send_graph(
+    void* ptr, uint64_t leaf, uint64_t unique, GC_Transfer** transfer,
+    GC_Env* gc_env
+) {
+    __GC_init_type_infos();
+    GC_Transfer_State state = {
+        .from = gc_env, .transfer = calloc(1, sizeof(GC_Transfer))
+    };
+    if (unique)
+    {
+        __GC_transfer_move_ref(&state, &ptr);
+        if (!leaf)
+        {
+            __GC_transfer_walk(&state, __GC_transfer_move_ref);
+        }
+    }
+    else
+    {
+        init_ptr_hashset(&state.copies, 64);
+        ptr = __GC_transfer_copy(&state, ptr);
+        if (!leaf)
+        {
+            __GC_transfer_walk(&state, __GC_transfer_copy_ref);
+        }
+        destroy_ptr_hashset(&state.copies);
+    }
+    *transfer = state.transfer;
+    return ptr;
+}
+
+// Called by the reader of a channel value once it has been read, with the
+// records written along with it. The value is only reachable through the
+// channel, so its records just change hands
+void __GC_receive_graph(GC_Transfer* transfer, GC_Env* gc_env)
+{
+    uint64_t i;
+    for (i = 0; i < transfer->allocs_len; i++)
+    {
+        __GC_arena_import(transfer->allocs[i], gc_env);
+        __GC_insert_alloc(transfer->allocs[i], gc_env);
+    }
+    free(transfer->allocs);
+    free(transfer);
+}
+
+// Drop the spawn arguments of gc_env that it has since collected, and the
+// repeats of those it hasn't
+static void __GC_prune_spawn_args(GC_Env* gc_env)
+{
+    ptr_hashset_t seen;
+    init_ptr_hashset(&seen, gc_env->spawn_args_len + 16);
+    uint64_t kept = 0;
+    uint64_t i;
+    for (i = 0; i < gc_env->spawn_args_len; i++)
+    {
+        void* ptr = gc_env->spawn_args[i];
+        if (__GC_find_alloc(ptr, gc_env) != NULL && add_key(&seen, ptr) == 0)
+        {
+            gc_env->spawn_args[kept++] = ptr;
+        }
+    }
+    gc_env->spawn_args_len = kept;
+    destroy_ptr_hashset(&seen);
+}
+
+// Called by the spawner of a green thread for each heap value it passes it
+void __GC_add_spawn_arg(void* ptr, GC_Env* gc_env)
+{
+    if (__GC_find_alloc(ptr, gc_env) == NULL)
+    {
+        return;
+    }
+    if (gc_env->spawn_args_len >= gc_env->spawn_args_end)
+    {
+        __GC_prune_spawn_args(gc_env);
+    }
+    // Grow unless pruning freed up at least half, so that a run of spawns
+    // prunes only every so often
+    if (gc_env->spawn_args_len * 2 >= gc_env->spawn_args_end)
+    {
+        gc_env->spawn_args_end = gc_env->spawn_args_end * 2 + 16;
+        gc_env->spawn_args = realloc(
+            gc_env->spawn_args, gc_env->spawn_args_end * sizeof(void*)
+        );
+    }
+    gc_env->spawn_args[gc_env->spawn_args_len++] = ptr;
+}
+
+// Stop tracking ptr and release its memory immediately, for C code that knows
+// the allocation is unreachable
+void __GC_free(void* ptr, GC_Env* gc_env)
+{
+    __GC_release_alloc(__GC_remove_alloc(ptr, gc_env), gc_env);
+}
+
+// Stack maps of the compiled Mellow functions, gathered by the linker from the
+// mellow_stackmaps sections the code generator emits. Weak, so that the runtime
+// still links into programs that have none
+extern GC_Stack_Map __start_mellow_stackmaps[] __attribute__((weak));
+extern GC_Stack_Map __stop_mellow_stackmaps[] __attribute__((weak));
+
+// The stack maps sorted by function address, built the first time a stack is
+// scanned
+static GC_Stack_Map** stack_maps = NULL;
+static uint64_t stack_maps_len = 0;
+static pthread_once_t stack_maps_once = PTHREAD_ONCE_INIT;
+
+static int __GC_compare_stack_maps(const void* a, const void* b)
+{
+    uint64_t start_a = (*(GC_Stack_Map**)a)->start;
+    uint64_t start_b = (*(GC_Stack_Map**)b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+static void __GC_sort_stack_maps()
+{
+    if (__start_mellow_stackmaps == NULL)
+    {
+        return;
+    }
+    uint64_t len = __stop_mellow_stackmaps - __start_mellow_stackmaps;
+    stack_maps = malloc(len * sizeof(GC_Stack_Map*));
+    uint64_t i;
+    for (i = 0; i < len; i++)
+    {
+        stack_maps[i] = &__start_mellow_stackmaps[i];
+    }
+    qsort(stack_maps, len, sizeof(GC_Stack_Map*), __GC_compare_stack_maps);
+    stack_maps_len = len;
+}
+
+// The stack map of the function a return address points into, or NULL if it
+// is not a compiled Mellow function. A return address can point just past the
+// end of a function whose last instruction is a call
+static GC_Stack_Map* __GC_find_stack_map(uint64_t ret)
+{
+    uint64_t low = 0;
+    uint64_t high = stack_maps_len;
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (stack_maps[mid]->start < ret)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == 0 || ret > stack_maps[low - 1]->end)
+    {
+        return NULL;
+    }
+    return stack_maps[low - 1];
+}
+
+static void __GC_mark_stack_word(void* ptr, GC_Env* gc_env)
+{
+    // If the value is "small" or not eight-byte aligned, it's very, very
+    // likely not a real pointer, so skip it. Note that if this heuristic is
+    // wrong, this will cause a leak
+    if ((uint64_t)ptr < 1024 || ((uint64_t)ptr & 0b111) != 0)
+    {
+        return;
+    }
+
+    if (__GC_mellow_is_valid_ptr(ptr, gc_env))
+    {
+        Marking_Func_Ptr mark_func_ptr = ((Marking_Func_Ptr*)(ptr))[0];
+        if (mark_func_ptr == 0)
+        {
+            assert(0);
+        }
+        mark_func_ptr(ptr);
+    }
+}
+
+// Treat every word in [from, to) as a possible pointer
+static void __GC_mark_stack_range(void** from, void** to, GC_Env* gc_env)
+{
+    if (from >= to)
+    {
+        return;
+    }
+    gc_env->stats.stack_bytes_scanned += (to - from) * 8;
+    for (; from < to; from++)
+    {
+        __GC_mark_stack_word(*from, gc_env);
+    }
+}
+
+// Mark everything reachable from the green thread stack between rsp and
+// stack_bot. rsp points at the return address into the function whose frame
+// is at rbp.
+//
+// The frames are walked through the saved rbp chain. The frame of a function
+// with a stack map only has its reference slots scanned. Everything else,
+// which is the frames of functions without one, outgoing arguments, and the
+// spawn arguments at the bottom of the stack, is scanned conservatively
+void __GC_mellow_mark_stack(
+    void** rsp, void** stack_bot, void** rbp, GC_Env* gc_env
+) {
+    pthread_once(&stack_maps_once, __GC_sort_stack_maps);
+
+    // Absolutely ensure we're 8-byte aligned
+    if ((uint64_t)rsp % 8 != 0) {
+        rsp = (void**)((uint64_t)rsp + (8 - ((uint64_t)rsp % 8)));
+    }
+    uint64_t ret = (uint64_t)rsp[0];
+    void** scan_from = rsp + 1;
+    void** frame = rbp;
+    // Stop at anything that isn't a frame further down this stack, such as
+    // the saved rbp of the scheduler at the bottom of it
+    while (
+        frame >= scan_from && frame + 2 <= stack_bot &&
+        ((uint64_t)frame & 0b111) == 0
+    ) {
+        GC_Stack_Map* map = __GC_find_stack_map(ret);
+        void** frame_top = map == NULL
+                         ? frame
+                         : frame - map->frame_size / 8;
+        if (frame_top < scan_from)
+        {
+            frame_top = scan_from;
+        }
+        __GC_mark_stack_range(scan_from, frame_top, gc_env);
+        if (map != NULL)
+        {
+            gc_env->stats.stack_bytes_scanned += map->ref_len * 8;
+            uint32_t i;
+            for (i = 0; i < map->ref_len; i++)
             {
-                assert(0);
+                void** slot = frame - map->ref_offsets[i] / 8;
+                if (slot >= scan_from)
+                {
+                    __GC_mark_stack_word(*slot, gc_env);
+                }
             }
-            mark_func_ptr(ptr);
         }
+        ret = (uint64_t)frame[1];
+        scan_from = frame + 2;
+        frame = (void**)frame[0];
     }
+    __GC_mark_stack_range(scan_from, stack_bot, gc_env);
 }
 
 uint64_t __GC_mellow_is_valid_ptr(void* ptr, GC_Env* gc_env)
@@ -166,12 +1163,23 @@ uint64_t __GC_mellow_is_valid_ptr(void* ptr, GC_Env* gc_env)
 
 void __GC_free_all_allocs(GC_Env* gc_env)
 {
+    __atomic_sub_fetch(
+        &gc_heap_total, gc_env->total_allocated, __ATOMIC_RELAXED
+    );
+    gc_env->total_allocated = 0;
+
     if (gc_env->allocs != NULL)
     {
+        // Allocations in our own chunks go with the chunks, so the records only
+        // need walking if some are not
         uint64_t i;
-        for (i = 0; i < gc_env->allocs_len; i++)
+        for (i = 0; gc_env->unpooled_len > 0 && i < gc_env->allocs_len; i++)
         {
-            free(gc_env->allocs[i].ptr);
+            if (!__GC_is_pooled(gc_env->allocs[i], gc_env))
+            {
+                __GC_release_alloc(gc_env->allocs[i], gc_env);
+                gc_env->unpooled_len--;
+            }
         }
         free(gc_env->allocs);
     }
@@ -180,6 +1188,22 @@ void __GC_free_all_allocs(GC_Env* gc_env)
     gc_env->allocs_len = 0;
     gc_env->allocs_end = 0;
 
+    if (gc_env->dead != NULL)
+    {
+        for (; gc_env->dead_index < gc_env->dead_len; gc_env->dead_index++)
+        {
+            __GC_release_block(gc_env->dead[gc_env->dead_index]);
+        }
+        free(gc_env->dead);
+    }
+
+    gc_env->dead = NULL;
+    gc_env->dead_len = 0;
+    gc_env->dead_end = 0;
+    gc_env->dead_index = 0;
+
+    __GC_arena_release_all(gc_env);
+
     if (gc_env->allocs_hashset != NULL)
     {
         destroy_ptr_hashset(gc_env->allocs_hashset);
@@ -187,6 +1211,370 @@ void __GC_free_all_allocs(GC_Env* gc_env)
     }
 }
 
+// Fold the telemetry of a finished green thread into the process totals, then
+// free everything it owned
+void __GC_destroy_env(GC_Env* gc_env)
+{
+    pthread_mutex_lock(&gc_stats_mutex);
+    process_green_threads++;
+    process_stats.collections += gc_env->stats.collections;
+    process_stats.mark_ns += gc_env->stats.mark_ns;
+    process_stats.sweep_ns += gc_env->stats.sweep_ns;
+    if (gc_env->stats.max_pause_ns > process_stats.max_pause_ns)
+    {
+        process_stats.max_pause_ns = gc_env->stats.max_pause_ns;
+    }
+    process_stats.bytes_allocated += gc_env->stats.bytes_allocated;
+    process_stats.bytes_freed += gc_env->stats.bytes_freed;
+    process_stats.stack_bytes_scanned += gc_env->stats.stack_bytes_scanned;
+    process_stats.compact_ns += gc_env->stats.compact_ns;
+    process_stats.bytes_evacuated += gc_env->stats.bytes_evacuated;
+    process_stats.chunks_evacuated += gc_env->stats.chunks_evacuated;
+    pthread_mutex_unlock(&gc_stats_mutex);
+
+    __GC_free_all_allocs(gc_env);
+    free(gc_env->spawn_args);
+    free(gc_env);
+}
+
+static void __GC_write_pacing_json(
+    FILE* out, uint64_t growth_percent, uint64_t min_heap, uint64_t soft_limit
+) {
+    if (growth_percent == GC_GROWTH_OFF)
+    {
+        fprintf(out, "\"growth_percent\": null, ");
+    }
+    else
+    {
+        fprintf(out, "\"growth_percent\": %" PRIu64 ", ", growth_percent);
+    }
+    fprintf(
+        out,
+        "\"min_heap_bytes\": %" PRIu64 ", \"soft_limit_bytes\": %" PRIu64,
+        min_heap, soft_limit
+    );
+}
+
+static void __GC_write_counters_json(FILE* out, GC_Stats* stats)
+{
+    fprintf(
+        out,
+        "\"collections\": %" PRIu64 ", "
+        "\"mark_ns\": %" PRIu64 ", "
+        "\"sweep_ns\": %" PRIu64 ", "
+        "\"max_pause_ns\": %" PRIu64 ", "
+        "\"bytes_allocated\": %" PRIu64 ", "
+        "\"bytes_freed\": %" PRIu64 ", "
+        "\"stack_bytes_scanned\": %" PRIu64 ", "
+        "\"compact_ns\": %" PRIu64 ", "
+        "\"bytes_evacuated\": %" PRIu64 ", "
+        "\"chunks_evacuated\": %" PRIu64,
+        stats->collections,
+        stats->mark_ns,
+        stats->sweep_ns,
+        stats->max_pause_ns,
+        stats->bytes_allocated,
+        stats->bytes_freed,
+        stats->stack_bytes_scanned,
+        stats->compact_ns,
+        stats->bytes_evacuated,
+        stats->chunks_evacuated
+    );
+}
+
+// Write the process-wide telemetry as a JSON object. If gc_env is not NULL, the
+// telemetry of that (still running) GC_Env is included as well
+void __GC_write_stats_json(FILE* out, GC_Env* gc_env)
+{
+    pthread_mutex_lock(&gc_stats_mutex);
+    GC_Stats stats = process_stats;
+    uint64_t green_threads = process_green_threads;
+    pthread_mutex_unlock(&gc_stats_mutex);
+
+    fprintf(out, "{\"process\": {");
+    fprintf(out, "\"finished_green_threads\": %" PRIu64 ", ", green_threads);
+    fprintf(out, "\"live_bytes\": %" PRIu64 ", ", __GC_heap_total());
+    fprintf(
+        out,
+        "\"background_sweep_ns\": %" PRIu64 ", ",
+        __atomic_load_n(&background_sweep_ns, __ATOMIC_RELAXED)
+    );
+    __GC_write_counters_json(out, &stats);
+    fprintf(out, ", \"pacing\": {");
+    __GC_write_pacing_json(
+        out, default_growth_percent, default_min_heap, default_soft_limit
+    );
+    fprintf(out, "}}");
+    if (gc_env != NULL)
+    {
+        fprintf(out, ", \"green_thread\": {");
+        fprintf(
+            out, "\"live_bytes\": %" PRIu64 ", ", gc_env->total_allocated
+        );
+        __GC_write_counters_json(out, &gc_env->stats);
+        fprintf(out, ", \"pacing\": {");
+        __GC_write_pacing_json(
+            out, gc_env->growth_percent, gc_env->min_heap, gc_env->soft_limit
+        );
+        fprintf(out, "}}");
+    }
+    fprintf(out, "}\n");
+}
+
+// If MELLOW_GC_STATS is set, write the process-wide telemetry to the file it
+// names, or to stderr if it is "-"
+void __GC_dump_stats_at_exit()
+{
+    const char* path = getenv("MELLOW_GC_STATS");
+    if (path == NULL || *path == '\0')
+    {
+        return;
+    }
+    if (strcmp(path, "-") == 0)
+    {
+        __GC_write_stats_json(stderr, NULL);
+        return;
+    }
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open MELLOW_GC_STATS file [%s]\n", path);
+        return;
+    }
+    __GC_write_stats_json(out, NULL);
+    fclose(out);
+}
+
+// Open the file MELLOW_HEAP_PROFILE names, or stderr if it is "-", to write a
+// heap profile to after every collection. Must be called before any GC_Env is
+// created
+void __GC_init_heap_profile()
+{
+    const char* path = getenv("MELLOW_HEAP_PROFILE");
+    if (path == NULL || *path == '\0')
+    {
+        return;
+    }
+    if (strcmp(path, "-") == 0)
+    {
+        heap_profile_out = stderr;
+        return;
+    }
+    heap_profile_out = fopen(path, "w");
+    if (heap_profile_out == NULL)
+    {
+        fprintf(
+            stderr, "Could not open MELLOW_HEAP_PROFILE file [%s]\n", path
+        );
+    }
+}
+
+// The start and end of the table of type information built from the
+// mellow_typeinfo sections the code generator emits. Weak, so that the runtime
+// still links into programs that have none
+extern GC_Type_Info __start_mellow_typeinfo[] __attribute__((weak));
+extern GC_Type_Info __stop_mellow_typeinfo[] __attribute__((weak));
+
+// The type information sorted by marking function, built the first time a heap
+// profile is written or a heap is compacted
+static GC_Type_Info** type_infos = NULL;
+static uint64_t type_infos_len = 0;
+static pthread_once_t type_infos_once = PTHREAD_ONCE_INIT;
+
+static int __GC_compare_type_infos(const void* a, const void* b)
+{
+    uint64_t func_a = (uint64_t)(*(GC_Type_Info**)a)->mark_func;
+    uint64_t func_b = (uint64_t)(*(GC_Type_Info**)b)->mark_func;
+    return (func_a > func_b) - (func_a < func_b);
+}
+
+static void __GC_sort_type_infos()
+{
+    if (__start_mellow_typeinfo == NULL)
+    {
+        return;
+    }
+    uint64_t len = __stop_mellow_typeinfo - __start_mellow_typeinfo;
+    type_infos = malloc(len * sizeof(GC_Type_Info*));
+    uint64_t i;
+    for (i = 0; i < len; i++)
+    {
+        type_infos[i] = &__start_mellow_typeinfo[i];
+    }
+    qsort(type_infos, len, sizeof(GC_Type_Info*), __GC_compare_type_infos);
+    type_infos_len = len;
+}
+
+static void __GC_init_type_infos()
+{
+    pthread_once(&type_infos_once, __GC_sort_type_infos);
+}
+
+// The information on the type whose marking function is mark_func, or NULL if
+// it is not one the code generator emitted
+static GC_Type_Info* __GC_find_type_info(Marking_Func_Ptr mark_func)
+{
+    uint64_t low = 0;
+    uint64_t high = type_infos_len;
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if ((uint64_t)type_infos[mid]->mark_func < (uint64_t)mark_func)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == type_infos_len || type_infos[low]->mark_func != mark_func)
+    {
+        return NULL;
+    }
+    return type_infos[low];
+}
+
+// The live objects and bytes of a heap profile that share a type or an
+// allocation site
+typedef struct {
+    void* key;
+    uint64_t objects;
+    uint64_t bytes;
+} GC_Heap_Tally;
+
+typedef struct {
+    // Maps each key to the index of its tally
+    ptr_hashset_t index;
+    GC_Heap_Tally* tallies;
+    uint64_t len;
+    uint64_t end;
+} GC_Heap_Tallies;
+
+static void __GC_tally(GC_Heap_Tallies* tallies, void* key, uint64_t size)
+{
+    key_node_t* node = find_key(&tallies->index, key);
+    if (node == NULL)
+    {
+        if (tallies->len >= tallies->end)
+        {
+            tallies->end = tallies->end * 2 + 16;
+            tallies->tallies = realloc(
+                tallies->tallies, tallies->end * sizeof(GC_Heap_Tally)
+            );
+        }
+        node = add_key_node(&tallies->index, key);
+        node->value = tallies->len;
+        tallies->tallies[tallies->len++] = (GC_Heap_Tally) { .key = key };
+    }
+    tallies->tallies[node->value].objects++;
+    tallies->tallies[node->value].bytes += size;
+}
+
+// Most bytes first
+static int __GC_compare_tallies(const void* a, const void* b)
+{
+    uint64_t bytes_a = ((GC_Heap_Tally*)a)->bytes;
+    uint64_t bytes_b = ((GC_Heap_Tally*)b)->bytes;
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+// Write a text report of the allocations gc_env tracks, tallied by type and by
+// allocation site, largest first. Right after a collection, these are exactly
+// the live objects. Types are named after the Mellow source, and sites as the
+// function label plus the offset of the return address of the allocating call
+void __GC_write_heap_profile(FILE* out, GC_Env* gc_env)
+{
+    pthread_once(&type_infos_once, __GC_sort_type_infos);
+    pthread_once(&stack_maps_once, __GC_sort_stack_maps);
+
+    GC_Heap_Tallies by_type = { 0 };
+    GC_Heap_Tallies by_site = { 0 };
+    init_ptr_hashset(&by_type.index, 64);
+    init_ptr_hashset(&by_site.index, 64);
+    uint64_t objects = 0;
+    uint64_t bytes = 0;
+    uint64_t i;
+    for (i = 0; i < gc_env->allocs_len; i++)
+    {
+        Allocation* alloc = &gc_env->allocs[i];
+        // The first word of every object is its marking function. Memory too
+        // small to have a header is tallied with the untyped objects
+        void* mark_func = NULL;
+        if (alloc->size >= sizeof(void*))
+        {
+            mark_func = *(void**)alloc->ptr;
+        }
+        __GC_tally(&by_type, mark_func, alloc->size);
+        __GC_tally(&by_site, alloc->site, alloc->size);
+        objects++;
+        bytes += alloc->size;
+    }
+    qsort(
+        by_type.tallies, by_type.len, sizeof(GC_Heap_Tally),
+        __GC_compare_tallies
+    );
+    qsort(
+        by_site.tallies, by_site.len, sizeof(GC_Heap_Tally),
+        __GC_compare_tallies
+    );
+
+    fprintf(
+        out,
+        "heap profile: %" PRIu64 " objects, %" PRIu64 " bytes after %" PRIu64
+        " collections\n",
+        objects, bytes, gc_env->stats.collections
+    );
+    fprintf(out, "%12s %10s  %s\n", "bytes", "objects", "type");
+    for (i = 0; i < by_type.len; i++)
+    {
+        GC_Heap_Tally* tally = &by_type.tallies[i];
+        fprintf(
+            out, "%12" PRIu64 " %10" PRIu64 "  ", tally->bytes, tally->objects
+        );
+        GC_Type_Info* info = __GC_find_type_info(
+            (Marking_Func_Ptr)tally->key
+        );
+        if (info != NULL)
+        {
+            fprintf(out, "%s\n", info->name);
+        }
+        else
+        {
+            fprintf(out, "<unknown %p>\n", tally->key);
+        }
+    }
+    fprintf(out, "%12s %10s  %s\n", "bytes", "objects", "site");
+    for (i = 0; i < by_site.len; i++)
+    {
+        GC_Heap_Tally* tally = &by_site.tallies[i];
+        fprintf(
+            out, "%12" PRIu64 " %10" PRIu64 "  ", tally->bytes, tally->objects
+        );
+        GC_Stack_Map* map = __GC_find_stack_map((uint64_t)tally->key);
+        if (tally->key == NULL)
+        {
+            fprintf(out, "<runtime>\n");
+        }
+        else if (map != NULL)
+        {
+            fprintf(
+                out, "%s+0x%" PRIx64 "\n",
+                map->name, (uint64_t)tally->key - map->start
+            );
+        }
+        else
+        {
+            fprintf(out, "%p\n", tally->key);
+        }
+    }
+
+    destroy_ptr_hashset(&by_type.index);
+    destroy_ptr_hashset(&by_site.index);
+    free(by_type.tallies);
+    free(by_site.tallies);
+}
+
 uint64_t __GC_mellow_is_marked(void* ptr)
 {
     // First eight bytes are the marking function ptr, second eight bytes are
@@ -201,61 +1589,661 @@ uint64_t __GC_mellow_is_marked(void* ptr)
     return 0;
 }
 
+// Unlink every unmarked allocation from the GC_Env, and reset the mark bit of
+// every marked one, in a single pass over allocs. Dead allocations are moved to
+// the dead list rather than free'd here; __GC_sweep_step() frees them lazily.
+//
+// Survivors must have their marks reset before the mutator resumes, as the mark
+// bit shares a word with the lengths of arrays and strings
 void __GC_sweep(GC_Env* gc_env)
 {
+    // Compact any already-free'd dead allocations out of the dead list, and
+    // make sure it can hold every allocation we might find dead
+    uint64_t pending = gc_env->dead_len - gc_env->dead_index;
+    if (gc_env->dead_index > 0)
+    {
+        uint64_t k;
+        for (k = 0; k < pending; k++)
+        {
+            gc_env->dead[k] = gc_env->dead[gc_env->dead_index + k];
+        }
+        gc_env->dead_index = 0;
+        gc_env->dead_len = pending;
+    }
+    if (pending + gc_env->allocs_len > gc_env->dead_end)
+    {
+        uint64_t new_size = pending + gc_env->allocs_end;
+        Allocation* new_dead = realloc(
+            gc_env->dead, new_size * sizeof(Allocation)
+        );
+        if (new_dead == NULL)
+        {
+            // Error case
+        }
+        gc_env->dead = new_dead;
+        gc_env->dead_end = new_size;
+    }
+
+    uint64_t i;
+    uint64_t live = 0;
+    uint64_t freed = 0;
+    for (i = 0; i < gc_env->allocs_len; i++)
+    {
+        Allocation alloc = gc_env->allocs[i];
+        if (__GC_mellow_is_marked(alloc.ptr) != 0)
+        {
+            // First eight bytes are the marking function ptr, second eight
+            // bytes are runtime data. First bit of the first byte of these
+            // second eight bytes is the mark bit
+            ((uint64_t*)(alloc.ptr))[1] &= 0x7FFFFFFFFFFFFFFF;
+            alloc.node->value = live;
+            gc_env->allocs[live] = alloc;
+            live++;
+        }
+        else
+        {
+            remove_key(gc_env->allocs_hashset, alloc.ptr);
+            freed += alloc.size;
+            if (!__GC_is_pooled(alloc, gc_env))
+            {
+                gc_env->unpooled_len--;
+            }
+            // Arena slots are cheap to give back, so only the rest are left
+            // to the lazy sweeper
+            if (alloc.arena)
+            {
+                __GC_release_alloc(alloc, gc_env);
+            }
+            else
+            {
+                gc_env->dead[gc_env->dead_len] = alloc;
+                gc_env->dead_len++;
+            }
+        }
+    }
+    gc_env->allocs_len = live;
+    gc_env->total_allocated -= freed;
+    gc_env->stats.bytes_freed += freed;
+    __atomic_sub_fetch(&gc_heap_total, freed, __ATOMIC_RELAXED);
+}
+
+// Free at most budget allocations from the dead list. Returns 1 if the dead
+// list has been emptied
+uint64_t __GC_sweep_step(GC_Env* gc_env, uint64_t budget)
+{
+    for (
+        ;
+        budget > 0 && gc_env->dead_index < gc_env->dead_len;
+        budget--, gc_env->dead_index++
+    ) {
+        __GC_release_block(gc_env->dead[gc_env->dead_index]);
+    }
+    if (gc_env->dead_index < gc_env->dead_len)
+    {
+        return 0;
+    }
+    gc_env->dead_index = 0;
+    gc_env->dead_len = 0;
+    return 1;
+}
+
+// An arena chunk of the GC_Env being compacted
+typedef struct {
+    GC_Arena_Chunk* chunk;
+    // Bytes of the chunk's slots taken by live allocations
+    uint64_t live;
+    // Set if something that can't be updated might point into the chunk, so
+    // that nothing in it may move
+    uint64_t pinned;
+    // Set if the live allocations of the chunk are being moved out of it
+    uint64_t evacuate;
+} GC_Compact_Chunk;
+
+typedef struct {
+    GC_Env* gc_env;
+    GC_Compact_Chunk* chunks;
+    // Maps the address of each chunk to its index in chunks
+    ptr_hashset_t chunk_index;
+    // Maps the old address of every moved allocation to its new one
+    ptr_hashset_t forward;
+    // Work list of the depth-first walks
+    void** pending;
+    uint64_t pending_len;
+    uint64_t pending_end;
+} GC_Compact_State;
+
+static GC_Compact_Chunk* __GC_compact_chunk_of(
+    GC_Compact_State* state, void* ptr
+) {
+    key_node_t* node = find_key(&state->chunk_index, __GC_chunk_of(ptr));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    return &state->chunks[node->value];
+}
+
+static void __GC_compact_push(GC_Compact_State* state, void* ptr)
+{
+    if (state->pending_len >= state->pending_end)
+    {
+        state->pending_end = state->pending_end * 2 + 16;
+        state->pending = realloc(
+            state->pending, state->pending_end * sizeof(void*)
+        );
+    }
+    state->pending[state->pending_len++] = ptr;
+}
+
+// The reference layout of the object at ptr, or NULL if it has none that can
+// be trusted. An allocation too small for a header, or whose header isn't
+// filled in yet, has none
+static const uint32_t* __GC_layout_of(void* ptr, uint64_t size)
+{
+    if (size < 16)
+    {
+        return NULL;
+    }
+    GC_Type_Info* info = __GC_find_type_info(*(Marking_Func_Ptr*)ptr);
+    if (info == NULL || (info->layout[0] & GC_LAYOUT_KIND_MASK)
+                        == GC_LAYOUT_OPAQUE)
+    {
+        return NULL;
+    }
+    return info->layout;
+}
+
+// Pin the chunk, if any, that each word in [from, to) points into. Interior
+// pointers count, as the words could be anything
+static void __GC_pin_range(GC_Compact_State* state, void** from, void** to)
+{
+    for (; from < to; from++)
+    {
+        GC_Compact_Chunk* chunk = __GC_compact_chunk_of(state, *from);
+        if (chunk != NULL)
+        {
+            chunk->pinned = 1;
+        }
+    }
+}
+
+// Pin everything reachable from the allocation at ptr, which other green
+// threads may hold references into. The graph is walked conservatively
+static void __GC_pin_graph(
+    GC_Compact_State* state, ptr_hashset_t* visited, void* ptr
+) {
+    GC_Env* gc_env = state->gc_env;
+    __GC_compact_push(state, ptr);
+    while (state->pending_len > 0)
+    {
+        void* next = state->pending[--state->pending_len];
+        key_node_t* node = find_key(gc_env->allocs_hashset, next);
+        if (node == NULL || add_key(visited, next) != 0)
+        {
+            continue;
+        }
+        Allocation* alloc = &gc_env->allocs[node->value];
+        GC_Compact_Chunk* chunk = __GC_compact_chunk_of(state, next);
+        if (chunk != NULL)
+        {
+            chunk->pinned = 1;
+        }
+        void** word = (void**)next;
+        void** end = (void**)((char*)next + (alloc->size & ~(uint64_t)7));
+        for (; word < end; word++)
+        {
+            __GC_compact_push(state, *word);
+        }
+    }
+}
+
+// Call visit, with state, on each reference slot of the object at ptr
+static void __GC_for_each_ref(
+    void* ptr, uint64_t size, const uint32_t* layout,
+    void (*visit)(void*, void**), void* state
+) {
+    const uint32_t* offsets = NULL;
+    uint32_t len = 0;
+    switch (layout[0] & GC_LAYOUT_KIND_MASK)
+    {
+    case GC_LAYOUT_ARRAY:
+        {
+            uint64_t elems = ((uint64_t*)ptr)[1] & 0x00FFFFFFFFFFFFFF;
+            if (elems > (size - 16) / 8)
+            {
+                elems = (size - 16) / 8;
+            }
+            uint64_t i;
+            for (i = 0; i < elems; i++)
+            {
+                visit(state, (void**)((char*)ptr + 16) + i);
+            }
+        }
+        return;
+    case GC_LAYOUT_FIELDS:
+        len = layout[1];
+        offsets = &layout[2];
+        break;
+    case GC_LAYOUT_VARIANT:
+        {
+            uint64_t tag = ((uint64_t*)ptr)[1] & 0xFFFF;
+            if (tag >= layout[1])
+            {
+                return;
+            }
+            const uint32_t* constructor = &layout[2];
+            uint64_t i;
+            for (i = 0; i < tag; i++)
+            {
+                constructor += 1 + constructor[0];
+            }
+            len = constructor[0];
+            offsets = &constructor[1];
+        }
+        break;
+    default:
+        return;
+    }
+    uint32_t i;
+    for (i = 0; i < len; i++)
+    {
+        if (offsets[i] + 8 <= size)
+        {
+            visit(state, (void**)((char*)ptr + offsets[i]));
+        }
+    }
+}
+
+// Move the allocation at ptr out of its chunk if the chunk is being evacuated
+// and the allocation hasn't been moved yet. Returns the new address, or NULL if
+// the allocation stays where it is
+static void* __GC_evacuate(GC_Compact_State* state, void* ptr)
+{
+    GC_Env* gc_env = state->gc_env;
+    key_node_t* node = find_key(gc_env->allocs_hashset, ptr);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    Allocation* alloc = &gc_env->allocs[node->value];
+    GC_Compact_Chunk* chunk = __GC_compact_chunk_of(state, ptr);
+    if (!alloc->arena || chunk == NULL || !chunk->evacuate)
+    {
+        return NULL;
+    }
+    void* new_ptr = __GC_arena_alloc(alloc->size, gc_env);
+    if (new_ptr == NULL)
+    {
+        // Out of memory for new chunks, so this one has to stay
+        chunk->evacuate = 0;
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, alloc->size);
+    uint64_t index = node->value;
+    remove_key(gc_env->allocs_hashset, ptr);
+    alloc->node = add_key_node(gc_env->allocs_hashset, new_ptr);
+    alloc->node->value = index;
+    alloc->ptr = new_ptr;
+    add_key_node(&state->forward, ptr)->value = (uint64_t)new_ptr;
+    gc_env->stats.bytes_evacuated += alloc->size;
+    return new_ptr;
+}
+
+static void __GC_push_ref(void* state, void** slot)
+{
+    if (*slot != NULL)
+    {
+        __GC_compact_push(state, *slot);
+    }
+}
+
+// Evacuate the allocation at ptr, if it is to be moved, and then what it
+// references, depth first, so that objects end up next to the objects that
+// point to them
+static void __GC_evacuate_graph(GC_Compact_State* state, void* ptr)
+{
+    GC_Env* gc_env = state->gc_env;
+    __GC_compact_push(state, ptr);
+    while (state->pending_len > 0)
+    {
+        void* next = state->pending[--state->pending_len];
+        void* moved = __GC_evacuate(state, next);
+        // Already moved, or not ours
+        if (moved == NULL && next != ptr)
+        {
+            continue;
+        }
+        if (moved != NULL)
+        {
+            next = moved;
+        }
+        key_node_t* node = find_key(gc_env->allocs_hashset, next);
+        if (node == NULL)
+        {
+            continue;
+        }
+        uint64_t size = gc_env->allocs[node->value].size;
+        const uint32_t* layout = __GC_layout_of(next, size);
+        if (layout != NULL)
+        {
+            __GC_for_each_ref(next, size, layout, __GC_push_ref, state);
+        }
+    }
+}
+
+// Point a reference slot at the new address of what it referenced, if that
+// moved
+static void __GC_update_ref(void* arg, void** slot)
+{
+    GC_Compact_State* state = arg;
+    key_node_t* forward = find_key(&state->forward, *slot);
+    if (forward != NULL)
+    {
+        *slot = (void*)forward->value;
+    }
+}
+
+// Take the free slots of the chunks being evacuated off the free lists, so
+// that nothing is moved into them
+static void __GC_compact_free_lists(GC_Compact_State* state)
+{
+    GC_Env* gc_env = state->gc_env;
+    uint64_t size_class;
+    for (size_class = 0; size_class < GC_ARENA_CLASSES; size_class++)
+    {
+        void** link = &gc_env->arena_free[size_class];
+        while (*link != NULL)
+        {
+            GC_Compact_Chunk* chunk = __GC_compact_chunk_of(state, *link);
+            if (chunk != NULL && chunk->evacuate)
+            {
+                *link = *(void**)*link;
+            }
+            else
+            {
+                link = (void**)*link;
+            }
+        }
+    }
+}
+
+// Defragment the arena chunks of gc_env, right after a collection. This is a
+// mostly-copying collector: the stack is only known conservatively, so every
+// chunk a stack word points into is pinned, while the heap is walked precisely
+// through the reference layouts of the mellow_typeinfo section. The live
+// allocations of the sparse, unpinned chunks are then moved into the free
+// slots of the other chunks or into new ones, every reference to them is
+// updated, and the emptied chunks are released.
+//
+// Objects whose layout isn't known, and everything reachable from values that
+// other green threads may share, or were passed as spawn arguments, never
+// move, nor does anything they might point to. Nor does anything in the chunk
+// new allocations are carved from, or in a chunk holding allocations that were
+// sent to another GC_Env. The stack words are [rsp, stack_bot)
+void __GC_compact(GC_Env* gc_env, void** rsp, void** stack_bot)
+{
+    if (gc_env->compact_percent == 0 || gc_env->chunks == NULL)
+    {
+        return;
+    }
+    pthread_once(&type_infos_once, __GC_sort_type_infos);
+
+    GC_Compact_State state = { .gc_env = gc_env };
+    uint64_t chunks_len = 0;
+    GC_Arena_Chunk* chunk;
+    for (chunk = gc_env->chunks; chunk != NULL; chunk = chunk->next)
+    {
+        chunks_len++;
+    }
+    state.chunks = calloc(chunks_len, sizeof(GC_Compact_Chunk));
+    init_ptr_hashset(&state.chunk_index, chunks_len);
     uint64_t i = 0;
-    uint64_t j = gc_env->allocs_len - 1;
-    uint64_t num_frees = 0;
-    // Move through the allocs array and free everything that needs to be
-    // free'd, while keeping the list of valid ptrs contiguous and left-
-    // justified. At the end of this loop, both i and j should be equal, and
-    // they will represent one-less than the new gc_env->allocs_len value. This
-    // algorithm is O(n), as the list of allocs need not be sorted
-    for (; i < j; i++)
-    {
-        if (__GC_mellow_is_marked(gc_env->allocs[i].ptr) == 0)
-        {
-            // Free the unmarked ptr
-            free(gc_env->allocs[i].ptr);
-            remove_key(gc_env->allocs_hashset, gc_env->allocs[i].ptr);
-            gc_env->total_allocated -= gc_env->allocs[i].size;
-            num_frees++;
-            // While rightmost ptr is unmarked, move left in search of a marked
-            // ptr, free'ing along the way
-            for (; j > i && __GC_mellow_is_marked(gc_env->allocs[j].ptr) == 0; j--)
+    for (chunk = gc_env->chunks; chunk != NULL; chunk = chunk->next, i++)
+    {
+        // Only gc_env adds holds to its own chunks, so one pinned here may
+        // only lose its other holds while gc_env compacts
+        state.chunks[i].chunk = chunk;
+        state.chunks[i].pinned = __atomic_load_n(
+            &chunk->holders, __ATOMIC_ACQUIRE
+        ) > 1;
+        add_key_node(&state.chunk_index, chunk)->value = i;
+    }
+    // New allocations are carved out of the newest chunk
+    state.chunks[0].pinned = 1;
+
+    __GC_pin_range(&state, rsp, stack_bot);
+    ptr_hashset_t visited;
+    init_ptr_hashset(&visited, 64);
+    for (i = 0; i < gc_env->allocs_len; i++)
+    {
+        Allocation* alloc = &gc_env->allocs[i];
+        GC_Compact_Chunk* alloc_chunk = __GC_compact_chunk_of(
+            &state, alloc->ptr
+        );
+        if (alloc->arena && alloc_chunk != NULL)
+        {
+            alloc_chunk->live += (__GC_arena_class(alloc->size) + 1)
+                               * GC_ARENA_CLASS_SIZE;
+        }
+        const uint32_t* layout = __GC_layout_of(alloc->ptr, alloc->size);
+        if (layout == NULL)
+        {
+            __GC_pin_range(
+                &state, (void**)alloc->ptr,
+                (void**)((char*)alloc->ptr + (alloc->size & ~(uint64_t)7))
+            );
+        }
+        else if (layout[0] & GC_LAYOUT_SHARED)
+        {
+            __GC_pin_graph(&state, &visited, alloc->ptr);
+        }
+    }
+    __GC_prune_spawn_args(gc_env);
+    for (i = 0; i < gc_env->spawn_args_len; i++)
+    {
+        __GC_pin_graph(&state, &visited, gc_env->spawn_args[i]);
+    }
+    destroy_ptr_hashset(&visited);
+
+    uint64_t usable = GC_ARENA_CHUNK_SIZE - GC_ARENA_CHUNK_HEADER;
+    uint64_t evacuating = 0;
+    for (i = 0; i < chunks_len; i++)
+    {
+        GC_Compact_Chunk* compact_chunk = &state.chunks[i];
+        if (
+            !compact_chunk->pinned &&
+            compact_chunk->live * 100 < usable * gc_env->compact_percent
+        ) {
+            compact_chunk->evacuate = 1;
+            evacuating++;
+        }
+    }
+
+    if (evacuating > 0)
+    {
+        init_ptr_hashset(&state.forward, 64);
+        __GC_compact_free_lists(&state);
+        // What the allocations that stay put reference first, then the rest.
+        // Moving an allocation doesn't change its index in allocs
+        uint64_t pass;
+        for (pass = 0; pass < 2; pass++)
+        {
+            for (i = 0; i < gc_env->allocs_len; i++)
             {
-                free(gc_env->allocs[j].ptr);
-                remove_key(gc_env->allocs_hashset, gc_env->allocs[j].ptr);
-                gc_env->total_allocated -= gc_env->allocs[j].size;
-                num_frees++;
+                Allocation* alloc = &gc_env->allocs[i];
+                GC_Compact_Chunk* alloc_chunk = __GC_compact_chunk_of(
+                    &state, alloc->ptr
+                );
+                uint64_t moves = alloc->arena && alloc_chunk != NULL &&
+                                 alloc_chunk->evacuate;
+                if (moves == pass)
+                {
+                    __GC_evacuate_graph(&state, alloc->ptr);
+                }
             }
-            // All ptrs from i to gc_env->allocs_len were free'd, so we're done
-            if (j == i)
+        }
+        for (i = 0; i < gc_env->allocs_len; i++)
+        {
+            Allocation* alloc = &gc_env->allocs[i];
+            const uint32_t* layout = __GC_layout_of(alloc->ptr, alloc->size);
+            if (layout != NULL)
             {
-                break;
+                __GC_for_each_ref(
+                    alloc->ptr, alloc->size, layout, __GC_update_ref, &state
+                );
+            }
+        }
+        destroy_ptr_hashset(&state.forward);
+
+        // Nothing is left in the evacuated chunks, and as none of them held
+        // allocations sent elsewhere, nothing else can be
+        GC_Arena_Chunk** link = &gc_env->chunks;
+        pthread_mutex_lock(&arena_mutex);
+        while (*link != NULL)
+        {
+            GC_Compact_Chunk* compact_chunk = __GC_compact_chunk_of(
+                &state, *link
+            );
+            if (compact_chunk != NULL && compact_chunk->evacuate)
+            {
+                GC_Arena_Chunk* released = *link;
+                *link = released->next;
+                __GC_arena_release_chunk(released);
+                gc_env->stats.chunks_evacuated++;
             }
-            // We found a ptr we can slot into the free spot i found, so
-            // make the move, decrement our "end" counter j, and loop
             else
             {
-                gc_env->allocs[i].ptr = gc_env->allocs[j].ptr;
-                gc_env->allocs[i].size = gc_env->allocs[j].size;
-                j--;
+                link = &(*link)->next;
             }
         }
+        pthread_mutex_unlock(&arena_mutex);
     }
-    // After this algorithm: gc_env->allocs_len == i == j
-    gc_env->allocs_len -= num_frees;
+
+    free(state.pending);
+    destroy_ptr_hashset(&state.chunk_index);
+    free(state.chunks);
 }
 
-void __GC_clear_marks(GC_Env* gc_env)
+#ifdef MULTITHREAD
+
+static void* __GC_sweeper(void* arg)
 {
+    pthread_mutex_lock(&sweeper_mutex);
+    while (1)
+    {
+        while (sweep_queue_head == NULL && sweepers_done == 0)
+        {
+            pthread_cond_wait(&sweeper_cond, &sweeper_mutex);
+        }
+        // Only exit once the queue is drained, so that every handed-off
+        // allocation is free'd before __GC_join_sweepers() returns
+        if (sweep_queue_head == NULL)
+        {
+            break;
+        }
+        GC_Sweep_Batch* batch = sweep_queue_head;
+        sweep_queue_head = batch->next;
+        if (sweep_queue_head == NULL)
+        {
+            sweep_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&sweeper_mutex);
+
+        uint64_t sweep_start = __GC_now_ns();
+        uint64_t i;
+        for (i = batch->start; i < batch->len; i++)
+        {
+            __GC_release_block(batch->dead[i]);
+        }
+        free(batch->dead);
+        free(batch);
+        __atomic_add_fetch(
+            &background_sweep_ns, __GC_now_ns() - sweep_start, __ATOMIC_RELAXED
+        );
+
+        pthread_mutex_lock(&sweeper_mutex);
+    }
+    pthread_mutex_unlock(&sweeper_mutex);
+
+    return NULL;
+}
+
+// Give the dead list of this GC_Env to the background sweeper pool, starting
+// the pool if it isn't already running. The dead allocations were unlinked
+// from the GC_Env by __GC_sweep(), so the pool shares no state with the
+// mutator
+void __GC_hand_off_dead(GC_Env* gc_env)
+{
+    if (gc_env->dead_index >= gc_env->dead_len)
+    {
+        return;
+    }
+
+    GC_Sweep_Batch* batch = (GC_Sweep_Batch*)malloc(sizeof(GC_Sweep_Batch));
+    batch->dead = gc_env->dead;
+    batch->start = gc_env->dead_index;
+    batch->len = gc_env->dead_len;
+    batch->next = NULL;
+
+    gc_env->dead = NULL;
+    gc_env->dead_len = 0;
+    gc_env->dead_end = 0;
+    gc_env->dead_index = 0;
+
+    pthread_mutex_lock(&sweeper_mutex);
+
+    if (sweepers_running == 0)
+    {
+        uint64_t i;
+        for (i = 0; i < GC_SWEEPER_THREADS; i++)
+        {
+            int resCode = pthread_create(
+                &sweeper_threads[i], NULL, __GC_sweeper, NULL
+            );
+            assert(0 == resCode);
+        }
+        sweepers_running = 1;
+    }
+
+    if (sweep_queue_tail == NULL)
+    {
+        sweep_queue_head = batch;
+    }
+    else
+    {
+        sweep_queue_tail->next = batch;
+    }
+    sweep_queue_tail = batch;
+
+    pthread_cond_signal(&sweeper_cond);
+
+    pthread_mutex_unlock(&sweeper_mutex);
+}
+
+// Wait for the sweeper pool to drain its queue, and stop it. The pool is
+// restarted by the next hand-off, should the runtime be restarted
+void __GC_join_sweepers()
+{
+    pthread_mutex_lock(&sweeper_mutex);
+    if (sweepers_running == 0)
+    {
+        pthread_mutex_unlock(&sweeper_mutex);
+        return;
+    }
+    sweepers_done = 1;
+    pthread_cond_broadcast(&sweeper_cond);
+    pthread_mutex_unlock(&sweeper_mutex);
+
     uint64_t i;
-    for (i = 0; i < gc_env->allocs_len; i++)
+    for (i = 0; i < GC_SWEEPER_THREADS; i++)
     {
-        // First eight bytes are the marking function ptr, second eight bytes
-        // are runtime data. First bit of the first byte of these second eight
-        // bytes is the mark bit
-        ((uint64_t*)(gc_env->allocs[i].ptr))[1] &= 0x7FFFFFFFFFFFFFFF;
+        pthread_join(sweeper_threads[i], NULL);
     }
+
+    pthread_mutex_lock(&sweeper_mutex);
+    sweepers_running = 0;
+    sweepers_done = 0;
+    pthread_mutex_unlock(&sweeper_mutex);
 }
+
+#endif
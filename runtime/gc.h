@@ -3,24 +3,114 @@
 #define GC_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "ptr_hashset.h"
 
 #define ALLOCS_START_SIZE 64
+// Allocations of at least this many bytes are placed in the large-object
+// space: each gets its own page-aligned anonymous mmap, which is munmap'd, and
+// so returned to the OS, as soon as the allocation is swept
+#define GC_LARGE_OBJECT_THRESHOLD (128 * 1024)
+// Allocations of at most this many bytes are carved out of chunks owned by
+// their GC_Env, in size classes GC_ARENA_CLASS_SIZE bytes apart. Each chunk is
+// GC_ARENA_CHUNK_SIZE bytes and aligned to its size, and tearing down a GC_Env
+// releases its chunks whole instead of free'ing objects one by one. Up to
+// GC_ARENA_POOL_CHUNKS released chunks are kept for the next GC_Env to use
+#define GC_ARENA_MAX_OBJECT 2048
+#define GC_ARENA_CLASS_SIZE 16
+#define GC_ARENA_CLASSES (GC_ARENA_MAX_OBJECT / GC_ARENA_CLASS_SIZE)
+#define GC_ARENA_CHUNK_SIZE (64 * 1024)
+#define GC_ARENA_POOL_CHUNKS 64
+// Number of dead allocations handed back to the system allocator each time the
+// GC allocator is entered while a lazy sweep is outstanding
+#define GC_SWEEP_STEP 64
+// Default GC pacing. A collection is triggered once a GC_Env has grown by
+// growth_percent percent over its size right after the last collection, but
+// never before it has reached min_heap bytes. The process-wide defaults can be
+// overridden with the MELLOW_GC_GROWTH (a percentage, or "off"),
+// MELLOW_GC_MIN_HEAP and MELLOW_GC_SOFT_LIMIT (byte counts, with an optional
+// K, M or G suffix) environment variables, and per GC_Env through std.runtime
+#define GC_DEFAULT_GROWTH_PERCENT 100
+#define GC_DEFAULT_MIN_HEAP (4 * 1024 * 1024)
+// A growth_percent value that disables growth-triggered collections
+#define GC_GROWTH_OFF UINT64_MAX
+// However close the process is to its soft memory limit, a GC_Env is still
+// allowed to grow by this fraction of its normal headroom between collections,
+// so that a heap that is entirely live doesn't collect on every allocation
+#define GC_SOFT_LIMIT_MIN_HEADROOM_DIVISOR 16
+// Compaction, off unless MELLOW_GC_COMPACT (a percentage, or "off") or
+// setGCCompactPercent() in std.runtime turns it on. After each collection, the
+// live allocations of every arena chunk less than this percent full are moved
+// into other chunks, and the emptied chunks are released. Chunks that the
+// stack or anything scanned conservatively might point into stay where they
+// are
+#define GC_DEFAULT_COMPACT_PERCENT 0
+// Number of callee-saved registers the __GC_malloc stubs in callFunc*.asm push
+// below the return address of their caller, so that any references the caller
+// keeps in them are seen by the collector
+#define GC_SAVED_REGISTERS 6
+// Number of kernel threads in the background sweeper pool of the
+// multithreaded runtime
+#define GC_SWEEPER_THREADS 2
+// Number of log2-microsecond buckets in the collection pause histogram. The
+// last bucket collects every pause at or above 2^(N-1) microseconds
+#define GC_PAUSE_HISTOGRAM_BUCKETS 24
 
 #ifdef GC_DEBUG
 
 extern uint64_t __mellow_debug_total_gc_collections;
+extern uint64_t __mellow_debug_gc_pause_histogram[GC_PAUSE_HISTOGRAM_BUCKETS];
+
+void __GC_debug_print_pause_histogram();
 
 #endif
 
 typedef struct {
     void* ptr;
-    uint64_t size;
+    uint64_t size : 61;
+    // Set if the allocation lives in the large-object space, and so must be
+    // released with munmap rather than free
+    uint64_t large : 1;
+    // Set if the allocation was carved out of an arena chunk, and so must be
+    // released to its size class rather than free'd
+    uint64_t arena : 1;
+    // Set if the last eight bytes of the allocation are an owner word, as laid
+    // down by the capacity-bearing array appends in stdlib/mellow_internal.c
+    uint64_t owned : 1;
+    // The allocs_hashset node for ptr, whose value is the index of this record
+    // in allocs. Stale once the allocation has been removed
+    key_node_t* node;
+    // The return address of the __GC_malloc call that made the allocation, for
+    // the heap profiler. NULL if it was made from within the runtime
+    void* site;
 } Allocation;
 
-// NOTE: If you add any fields to this struct, remember to fix the allocation
-// size and initialization of this struct in the callFunc*.asm files, under
-// callFunc()
+// Telemetry kept by every GC_Env, and aggregated process-wide as green threads
+// are torn down. Durations are in nanoseconds
+typedef struct {
+    // Number of collections
+    uint64_t collections;
+    // Time spent scanning the stack and marking
+    uint64_t mark_ns;
+    // Time spent sweeping, both during collections and lazily afterward
+    uint64_t sweep_ns;
+    // Longest single collection pause
+    uint64_t max_pause_ns;
+    // Cumulative bytes allocated through the GC
+    uint64_t bytes_allocated;
+    // Cumulative bytes found dead by collections
+    uint64_t bytes_freed;
+    // Cumulative bytes of green thread stack scanned for pointers
+    uint64_t stack_bytes_scanned;
+    // Time spent compacting, and the bytes moved and chunks emptied by it
+    uint64_t compact_ns;
+    uint64_t bytes_evacuated;
+    uint64_t chunks_evacuated;
+} GC_Stats;
+
+// NOTE: New GC_Env objects are created by __GC_new_env(), called from
+// callFunc() in the callFunc*.asm files. Any new fields must be valid when
+// zero-initialized, or be initialized there
 
 typedef struct {
     // List of all allocations made by the GC
@@ -29,7 +119,7 @@ typedef struct {
     uint64_t allocs_len;
     // Size of the allocations list (total size allocated for array)
     uint64_t allocs_end;
-    // Hashset of live pointers
+    // Hashset of live pointers, mapping each to its index in allocs
     ptr_hashset_t* allocs_hashset;
     // This is the value of the total amount of alloc'd memory that the GC was
     // in charge of immediately _after_ the last collection
@@ -37,24 +127,135 @@ typedef struct {
     // Total amount of memory currently allocated by GC. Running total,
     // incremented when allocations are made and decremented when freed
     uint64_t total_allocated;
+    // Pacing settings, initialized from the process-wide defaults. See
+    // GC_DEFAULT_GROWTH_PERCENT
+    uint64_t growth_percent;
+    uint64_t min_heap;
+    // Soft limit on the GC'd memory of the whole process, in bytes. 0 means
+    // no limit. As the limit is approached, this GC_Env collects more often
+    uint64_t soft_limit;
+    // Arena chunks less than this percent full are evacuated after each
+    // collection. 0 means no compaction. See GC_DEFAULT_COMPACT_PERCENT
+    uint64_t compact_percent;
+    // Allocations found dead by a collection that have not yet been free'd.
+    // They have already been removed from allocs, allocs_hashset, and
+    // total_allocated, so nothing can reach them anymore, and the lazy sweeper
+    // frees dead[dead_index, dead_len) a few at a time
+    Allocation* dead;
+    // Length of the dead list
+    uint64_t dead_len;
+    // Size of the dead list (total size allocated for array)
+    uint64_t dead_end;
+    // Index of the next dead allocation to be free'd
+    uint64_t dead_index;
+    // Arena chunks owned by this GC_Env, newest first
+    struct GC_Arena_Chunk* chunks;
+    // Unused tail of the newest chunk
+    char* arena_next;
+    char* arena_end;
+    // Free slots of each size class, linked through their first word
+    void* arena_free[GC_ARENA_CLASSES];
+    // Number of allocations in allocs that are not in this GC_Env's own
+    // chunks, and so must be released one by one when it is torn down
+    uint64_t unpooled_len;
+    // Values this green thread passed as spawn arguments. The spawned green
+    // threads hold them on their own stacks, which compaction of this GC_Env
+    // never scans, so their object graphs are pinned instead
+    void** spawn_args;
+    uint64_t spawn_args_len;
+    uint64_t spawn_args_end;
+    GC_Stats stats;
 } GC_Env;
 
 typedef void (*Marking_Func_Ptr)(void* ptr);
 
+// The stack map of a compiled Mellow function, one per function in the
+// mellow_stackmaps section. See StackMapEntry in CodeGenerator.d
+typedef struct {
+    // The code of the function is [start, end)
+    uint64_t start;
+    uint64_t end;
+    // The rbp-relative offsets of the frame slots that can hold a reference,
+    // the slot at offset o being at rbp-o
+    uint32_t* ref_offsets;
+    // The label of the function, which the heap profiler names allocation
+    // sites by
+    const char* name;
+    // Size of the frame below the saved rbp, in bytes
+    uint32_t frame_size;
+    uint32_t ref_len;
+} GC_Stack_Map;
+
+// Kinds of reference layout, the first word of GC_Type_Info.layout. The words
+// after it depend on the kind. See getRefLayout() in typedecl.d
+//
+// No references
+#define GC_LAYOUT_LEAF 0
+// An array whose every element is a reference
+#define GC_LAYOUT_ARRAY 1
+// layout[1] references, at the byte offsets layout[2..]
+#define GC_LAYOUT_FIELDS 2
+// layout[1] constructors. For each in turn, the number of references followed
+// by their byte offsets. The variant tag picks the constructor
+#define GC_LAYOUT_VARIANT 3
+// Unknown, so the object is only ever scanned conservatively
+#define GC_LAYOUT_OPAQUE 4
+#define GC_LAYOUT_KIND_MASK 0xFF
+// Set if other green threads may hold references into the object graph of a
+// value of the type, as they can for anything that reaches a channel or
+// function pointer
+#define GC_LAYOUT_SHARED 0x100
+
+// The allocation records of a value in flight over a channel. See
+// __GC_send_graph()
+typedef struct GC_Transfer GC_Transfer;
+
+// The name and reference layout of a type, one per marking function in the
+// mellow_typeinfo section. See compileMarkingFunctions in main.d
+typedef struct {
+    Marking_Func_Ptr mark_func;
+    const char* name;
+    const uint32_t* layout;
+} GC_Type_Info;
+
+void __GC_init_pacing();
+GC_Env* __GC_new_env();
+uint64_t __GC_heap_total();
 void __GC_mellow_add_alloc_wrapped(void* ptr, uint64_t size, GC_Env* gc_env);
 void* __GC_malloc_wrapped(
-    uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot
+    uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot, void** rbp
 );
 void* __GC_realloc_wrapped(
     void* ptr, uint64_t size, GC_Env* gc_env, void** rsp, void** stack_bot
 );
-void __GC_remove_alloc(void* ptr, GC_Env* gc_env);
+Allocation __GC_remove_alloc(void* ptr, GC_Env* gc_env);
+Allocation* __GC_find_alloc(void* ptr, GC_Env* gc_env);
+void* __GC_send_graph(
+    void* ptr, uint64_t leaf, uint64_t unique, GC_Transfer** transfer,
+    GC_Env* gc_env
+);
+void __GC_add_spawn_arg(void* ptr, GC_Env* gc_env);
+void __GC_receive_graph(GC_Transfer* transfer, GC_Env* gc_env);
+void __GC_free(void* ptr, GC_Env* gc_env);
 void* __GC_malloc_nocollect(uint64_t size, GC_Env* gc_env);
-void __GC_mellow_mark_stack(void** rsp, void** stack_bot, GC_Env* gc_env);
+void __GC_mellow_mark_stack(
+    void** rsp, void** stack_bot, void** rbp, GC_Env* gc_env
+);
 uint64_t __GC_mellow_is_valid_ptr(void* ptr, GC_Env* gc_env);
 void __GC_free_all_allocs(GC_Env* gc_env);
+void __GC_destroy_env(GC_Env* gc_env);
+void __GC_write_stats_json(FILE* out, GC_Env* gc_env);
+void __GC_dump_stats_at_exit();
+void __GC_init_heap_profile();
+void __GC_write_heap_profile(FILE* out, GC_Env* gc_env);
 void __GC_sweep(GC_Env* gc_env);
-void __GC_clear_marks(GC_Env* gc_env);
+uint64_t __GC_sweep_step(GC_Env* gc_env, uint64_t budget);
+void __GC_compact(GC_Env* gc_env, void** rsp, void** stack_bot);
+
+#ifdef MULTITHREAD
+void __GC_hand_off_dead(GC_Env* gc_env);
+void __GC_join_sweepers();
+#endif
 
 void __mellow_GC_mark_string(void* ptr);
 
@@ -339,6 +339,68 @@ char add_key(ptr_hashset_t *hashset, void *key)
 
 
 
+/*
+* Add the given key to this hashset, returning the node that holds it so the
+* caller can attach a value to the key
+*
+*
+* @param hashset
+*    The hashset we're adding to
+*
+* @param key
+*    The key to add to this hashset
+*
+*
+* @return
+*    The node holding key. If the key was already in the set, this is the
+*    existing node, and its value is left untouched
+*/
+key_node_t *add_key_node(ptr_hashset_t *hashset, void *key)
+{
+    key_node_t *existing = find_key(hashset, key);
+    if(existing != NULL)
+    {
+        return existing;
+    }
+
+    // If this fails we've got problems
+    key_node_t *newNode = alloc_node(hashset);
+
+    newNode->key = key;
+    add_node(hashset,newNode);
+    return newNode;
+}
+
+
+/*
+* Find the node holding the given key
+*
+* @param key
+*        The key we're looking for
+*
+* @return
+*        The node holding key, or NULL if the key is not in this set
+*
+*/
+key_node_t *find_key(ptr_hashset_t *hashset, void *key)
+{
+    uint64_t index = ( rehash(key) ) & ((hashset->_capacity) - 1);
+    key_node_t * chain = (hashset->buckets)[index];
+
+    while(chain != NULL)
+    {
+        if((chain->key) == (key) )
+        {
+            return chain;
+        }
+        chain = chain->next;
+    }
+
+    // If we reach here, we don't have this key
+    return NULL;
+}
+
+
 /*
 * Removes the given key from this set, if it is contained in the set
 *
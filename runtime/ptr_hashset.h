@@ -6,9 +6,15 @@
 // Simple singly-linked list style node for chaining method of bucket storage
 typedef struct keyNode
 {
-    // The key stored in this node (as this is a set, also the value)
+    // The key stored in this node
     void *key;
 
+    // Caller-owned data associated with the key. The hashset never reads or
+    // writes this, and it is undefined until set by the caller. Nodes are
+    // never moved once handed out, so a pointer to a node stays valid until
+    // its key is removed
+    uint64_t value;
+
     // The next node in this linked list (NULL if final node)
     struct keyNode *next;
 
@@ -110,6 +116,36 @@ void destroy_ptr_hashset(ptr_hashset_t * hashset);
 */
 char add_key(ptr_hashset_t *hashset, void *key);
 
+/*
+* Add the given key to this hashset, returning the node that holds it so the
+* caller can attach a value to the key
+*
+*
+* @param hashset
+*    The hashset we're adding to
+*
+* @param key
+*    The key to add to this hashset
+*
+*
+* @return
+*    The node holding key. If the key was already in the set, this is the
+*    existing node, and its value is left untouched
+*/
+key_node_t *add_key_node(ptr_hashset_t *hashset, void *key);
+
+/*
+* Find the node holding the given key
+*
+* @param key
+*        The key we're looking for
+*
+* @return
+*        The node holding key, or NULL if the key is not in this set
+*
+*/
+key_node_t *find_key(ptr_hashset_t *hashset, void *key);
+
 /*
 * Removes the given key from this set, if it is contained in the set
 *
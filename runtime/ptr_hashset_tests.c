@@ -222,6 +222,40 @@ void test1(ptr_hashset_t *hashset)
         printf("Passed re-adding and contains test...\n\n");
     }
 
+    hasError = 0;
+    val = 0;
+    while(val < 800000)
+    {
+        key_node_t *node = add_key_node(hashset,(void*)val);
+        node->value = val;
+        if(find_key(hashset,(void*)val) != node)
+        {
+            hasError = 1;
+            printf("ERROR: Failed to find node:\t%lu\n",val);
+        }
+        val += 8;
+    }
+    val = 0;
+    while(val < 800000)
+    {
+        key_node_t *node = find_key(hashset,(void*)val);
+        if(node == NULL || node->value != val)
+        {
+            hasError = 1;
+            printf("ERROR: Lost value for key:\t%lu\n",val);
+        }
+        val += 8;
+    }
+    if(find_key(hashset,(void*)1) != NULL)
+    {
+        hasError = 1;
+        printf("ERROR: Found node in error:\t1\n");
+    }
+    if(!hasError)
+    {
+        printf("Passed node value test...\n\n");
+    }
+
 
     printf("Longest chain:\n%lu\n",longestChain(hashset));
     printf("Average chain length:\n%lf\n",avgChainLength(hashset));
@@ -82,27 +82,23 @@ uint64_t __mremap_stack(ThreadData* thread, const uint64_t rsp)
     const uint64_t newRsp = (uint64_t)(
         newStackUsable + newStackSizeUsable - deltaFromTop
     );
-    // We need to fix all of the push'd rbp's in the stack, as they all
-    // currently point to locations in the old stack, meaning every single
-    // one of them wants us to segfault. Luckily, each rbp points to the
-    // previous rbp, all the way down, so just follow them like a pointer
-    // linked-list, fixing them as well go to point to their analog in the
-    // new stack allocation
-    uint64_t old_rbp_index = (rsp - (uint64_t)oldStackUsable) / 8;
-    uint64_t old_rbp = ((uint64_t*)oldStackUsable)[old_rbp_index];
-    while (old_rbp >= (uint64_t)oldStackUsable
-        && old_rbp <= (uint64_t)(oldStackUsable + oldStackSizeUsable))
+    // We need to fix every pointer into the stack that the stack holds, as
+    // they all currently point to locations in the old stack, meaning every
+    // single one of them wants us to segfault. These are the push'd rbp's,
+    // each pointing to the previous rbp, but also the references to the
+    // structs, tuples, and variants that functions build in their own frames.
+    // The stack is only known conservatively, so every word of the used stack
+    // that falls within the old stack is taken to be such a pointer, and made
+    // to point to its analog in the new stack allocation
+    const uint64_t oldBot = (uint64_t)(oldStackUsable + oldStackSizeUsable);
+    const uint64_t newBot = (uint64_t)(newStackUsable + newStackSizeUsable);
+    uint64_t* word;
+    for (word = (uint64_t*)newRsp; word < (uint64_t*)newBot; word++)
     {
-        deltaFromTop = (uint64_t)(
-            oldStackUsable + oldStackSizeUsable - old_rbp
-        );
-        uint64_t new_rbp = (uint64_t)(
-            newStackUsable + newStackSizeUsable - deltaFromTop
-        );
-        uint64_t new_raw_index = old_rbp_index + (oldStackSizeUsable / 8);
-        ((uint64_t*)newStackUsable)[new_raw_index] = new_rbp;
-        old_rbp_index = (old_rbp - (uint64_t)oldStackUsable) / 8;
-        old_rbp = ((uint64_t*)oldStackUsable)[old_rbp_index];
+        if (*word >= (uint64_t)oldStackUsable && *word <= oldBot)
+        {
+            *word = newBot - (oldBot - *word);
+        }
     }
     // Free the old stack
     munmap(oldStackRaw, oldStackSize);
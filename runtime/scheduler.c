@@ -75,8 +75,7 @@ void deallocThreadData(ThreadData* thread)
     GC_Env* gcEnv = thread->gcEnv;
     if (gcEnv != NULL)
     {
-        __GC_free_all_allocs(gcEnv);
-        free(gcEnv);
+        __GC_destroy_env(gcEnv);
         thread->gcEnv = NULL;
     }
 
@@ -103,6 +102,9 @@ void initThreadManager()
     // Init ThreadData* array index tracker
     g_threadManager->threadArrIndex = 0;
 
+    __GC_init_pacing();
+    __GC_init_heap_profile();
+
     numCores = sysconf(_SC_NPROCESSORS_ONLN);
     numThreads = numCores;
 
@@ -342,6 +344,9 @@ void execScheduler()
         assert(0 == resCode);
     }
     scheduler();
+    // Every green thread is done, so let the background sweepers finish
+    // freeing what they were handed
+    __GC_join_sweepers();
 #else
     __init_tempstack();
     uint32_t i = 0;
@@ -362,8 +367,7 @@ void execScheduler()
             GC_Env* gcEnv = curThread->gcEnv;
             if (gcEnv != NULL)
             {
-                __GC_free_all_allocs(gcEnv);
-                free(gcEnv);
+                __GC_destroy_env(gcEnv);
                 curThread->gcEnv = NULL;
             }
         }
@@ -375,11 +379,13 @@ void execScheduler()
     }
     __free_tempstack();
 #endif
+    __GC_dump_stats_at_exit();
 #ifdef GC_DEBUG
     printf(
         "Total GC collections: %" PRIu64 "\n",
         __mellow_debug_total_gc_collections
     );
+    __GC_debug_print_pause_histogram();
 #endif
 }
 
@@ -176,6 +176,133 @@ void* __arr_elem_append(void* left, uint64_t right,
     return new_arr;
 }
 
+// Arrays grown with ~= are given spare capacity, so that building an array
+// one append at a time is amortized O(1) rather than O(N) per append.
+//
+// Appending in place changes the length stored in the array itself, which any
+// other reference to the same array would also see. So the compiler only
+// calls these for a ~= to a local that is never copied anywhere, which is then
+// the one reference to every array its own ~= allocated. The allocation ends
+// in an owner word holding the token of the function activation whose ~=
+// allocated it, handed out from a global counter the first time that
+// activation appends, so no other activation, and no other reference, can
+// ever present a matching token. A ~= whose token doesn't match copies into a
+// new array that the activation then owns
+static uint64_t append_token_counter = 0;
+
+static void* __append_equals(void** slot, void* right_arr, uint64_t right,
+                             size_t elem_size, uint64_t is_str,
+                             uint64_t* token)
+{
+    GC_Env* gc_env = __get_GC_Env();
+    if (*token == 0)
+    {
+        *token = __atomic_add_fetch(
+            &append_token_counter, 1, __ATOMIC_RELAXED
+        );
+    }
+    void* left = *slot;
+    size_t llen = ((uint64_t*)left)[1];
+    size_t rlen = right_arr != NULL ? ((uint64_t*)right_arr)[1] : 1;
+    size_t nlen = llen + rlen;
+
+    Allocation* alloc = __GC_find_alloc(left, gc_env);
+    if (alloc != NULL && alloc->owned)
+    {
+        uint64_t owner;
+        memcpy(
+            &owner, (uint8_t*)left + alloc->size - OWNER_SIZE, OWNER_SIZE
+        );
+        size_t room = alloc->size - OWNER_SIZE - HEAD_SIZE - is_str;
+        if (owner == *token && nlen * elem_size <= room)
+        {
+            if (right_arr != NULL)
+            {
+                memmove(
+                    (uint8_t*)left + HEAD_SIZE + (llen * elem_size),
+                    (uint8_t*)right_arr + HEAD_SIZE,
+                    rlen * elem_size
+                );
+            }
+            else
+            {
+                memcpy(
+                    (uint8_t*)left + HEAD_SIZE + (llen * elem_size),
+                    &right,
+                    elem_size
+                );
+            }
+            if (is_str != 0)
+            {
+                ((uint8_t*)left)[HEAD_SIZE + nlen] = '\0';
+            }
+            ((uint64_t*)left)[1] = nlen;
+            return left;
+        }
+    }
+
+    // Grow geometrically, so a run of appends to this local copies each
+    // element only a constant number of times
+    size_t capacity = nlen * 2;
+    if (capacity < APPEND_MIN_CAPACITY)
+    {
+        capacity = APPEND_MIN_CAPACITY;
+    }
+    size_t full_len = HEAD_SIZE + (capacity * elem_size) + is_str + OWNER_SIZE;
+    void* new_arr = __GC_malloc(full_len, gc_env);
+    __GC_find_alloc(new_arr, gc_env)->owned = 1;
+    memcpy(
+        (uint8_t*)new_arr + full_len - OWNER_SIZE, token, OWNER_SIZE
+    );
+
+    // The collection __GC_malloc() may have run leaves left where it was, as
+    // it is still reachable through slot
+    left = *slot;
+    ((Marking_Func_Ptr*)new_arr)[0] = ((Marking_Func_Ptr*)left)[0];
+    ((uint64_t*)new_arr)[1] = nlen;
+    memcpy(
+        (uint8_t*)new_arr + HEAD_SIZE,
+        (uint8_t*)left + HEAD_SIZE,
+        llen * elem_size
+    );
+    if (right_arr != NULL)
+    {
+        memcpy(
+            (uint8_t*)new_arr + HEAD_SIZE + (llen * elem_size),
+            (uint8_t*)right_arr + HEAD_SIZE,
+            rlen * elem_size
+        );
+    }
+    else
+    {
+        memcpy(
+            (uint8_t*)new_arr + HEAD_SIZE + (llen * elem_size),
+            &right,
+            elem_size
+        );
+    }
+    if (is_str != 0)
+    {
+        ((uint8_t*)new_arr)[HEAD_SIZE + nlen] = '\0';
+    }
+    *slot = new_arr;
+    return new_arr;
+}
+
+void* __arr_arr_append_equals(void** slot, void* right,
+                              size_t elem_size, uint64_t is_str,
+                              uint64_t* token)
+{
+    return __append_equals(slot, right, 0, elem_size, is_str, token);
+}
+
+void* __arr_elem_append_equals(void** slot, uint64_t right,
+                               size_t elem_size, uint64_t is_str,
+                               uint64_t* token)
+{
+    return __append_equals(slot, NULL, right, elem_size, is_str, token);
+}
+
 void* __elem_elem_append(
     uint64_t left, uint64_t right, size_t elem_size, uint64_t is_str,
     Marking_Func_Ptr runtime_ptr
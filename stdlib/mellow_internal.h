@@ -11,6 +11,14 @@
 //     1 null-byte
 // ]
 
+// mellow-array or mellow-string grown by ~=:
+// [
+//     uint64_t runtime header, uint64_t length, capacity elems [],
+//     1 null-byte if a string, uint64_t owner
+// ]
+// The allocation is flagged as owned with the GC, and the owner is the token of
+// the function activation whose ~= allocated it
+
 // mellow-maybe:
 // [
 //     uint64_t runtime header, uint64_t variant tag,
@@ -23,6 +31,9 @@
 #define MARK_PTR_SIZE (8)
 #define LEN_SIZE (8)
 #define HEAD_SIZE (MARK_PTR_SIZE + LEN_SIZE)
+#define OWNER_SIZE (8)
+// Smallest number of elements an array is given room for when ~= grows it
+#define APPEND_MIN_CAPACITY (4)
 
 // Defined in callFunc*.asm
 void* __GC_malloc(uint64_t size, GC_Env* gc_env);
@@ -51,6 +62,17 @@ void* __elem_elem_append(
     Marking_Func_Ptr resultant_arr_runtime_ptr
 );
 
+// The ~= operator on a local that is never copied. slot is the address of the
+// local, and token the address of the calling activation's append token, zero
+// until its first append. The result is also stored back through slot
+void* __arr_arr_append_equals(void** slot, void* right,
+                              size_t elem_size, uint64_t is_str,
+                              uint64_t* token);
+
+void* __arr_elem_append_equals(void** slot, uint64_t right,
+                               size_t elem_size, uint64_t is_str,
+                               uint64_t* token);
+
 void* __arr_slice(void* arr, uint64_t lindex, uint64_t rindex,
                   uint64_t elem_size, uint64_t is_str);
 
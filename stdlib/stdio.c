@@ -188,15 +188,15 @@ struct MaybeStr* readText(struct MellowFile* file)
         size_t fileSize = stat_struct.st_size;
 
         size_t strAllocSize = HEAD_SIZE + fileSize + 1;
-        void* mellowStr = malloc(strAllocSize);
+        // Large files land in the GC's large-object space, so their memory is
+        // returned to the OS as soon as the string is collected
+        void* mellowStr = __GC_malloc_nocollect(strAllocSize, gc_env);
 
         size_t bytesRead = fread(mellowStr + HEAD_SIZE, 1, fileSize, fd);
 
         // Successfully read the file
         if (bytesRead == fileSize)
         {
-            // Add string to GC tracking
-            __GC_mellow_add_alloc_wrapped(mellowStr, strAllocSize, gc_env);
             // Set the string marking function
             ((void**)mellowStr)[0] = __mellow_GC_mark_S;
             // Set the string length
@@ -215,7 +215,7 @@ struct MaybeStr* readText(struct MellowFile* file)
             // Set tag to None
             maybeStr->variantTag = 1;
             // We failed to fully read in the file
-            free(mellowStr);
+            __GC_free(mellowStr, gc_env);
         }
     }
     else
@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "stdruntime.h"
+#include "mellow_internal.h"
+#include "../runtime/runtime_vars.h"
+
+void setGCGrowthPercent(int32_t percent)
+{
+    GC_Env* gc_env = __get_GC_Env();
+    if (percent < 0)
+    {
+        gc_env->growth_percent = GC_GROWTH_OFF;
+    }
+    else
+    {
+        gc_env->growth_percent = (uint64_t)percent;
+    }
+}
+
+void setGCMinHeapKB(int32_t kilobytes)
+{
+    GC_Env* gc_env = __get_GC_Env();
+    gc_env->min_heap = kilobytes < 0 ? 0 : (uint64_t)kilobytes << 10;
+}
+
+void setGCSoftLimitKB(int32_t kilobytes)
+{
+    GC_Env* gc_env = __get_GC_Env();
+    gc_env->soft_limit = kilobytes < 0 ? 0 : (uint64_t)kilobytes << 10;
+}
+
+void setGCCompactPercent(int32_t percent)
+{
+    GC_Env* gc_env = __get_GC_Env();
+    if (percent < 0)
+    {
+        percent = 0;
+    }
+    gc_env->compact_percent = percent > 100 ? 100 : (uint64_t)percent;
+}
+
+void* gcStatsJSON()
+{
+    char* buffer = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&buffer, &len);
+    __GC_write_stats_json(out, __get_GC_Env());
+    fclose(out);
+    // Drop the trailing newline
+    if (len > 0 && buffer[len - 1] == '\n')
+    {
+        len--;
+    }
+    void* str = mellow_allocString(buffer, len);
+    free(buffer);
+    return str;
+}
+
+void* heapProfileText()
+{
+    char* buffer = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&buffer, &len);
+    __GC_write_heap_profile(out, __get_GC_Env());
+    fclose(out);
+    void* str = mellow_allocString(buffer, len);
+    free(buffer);
+    return str;
+}
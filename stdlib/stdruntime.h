@@ -0,0 +1,13 @@
+#ifndef STDRUNTIME_H
+#define STDRUNTIME_H
+
+#include <stdint.h>
+
+void setGCGrowthPercent(int32_t percent);
+void setGCMinHeapKB(int32_t kilobytes);
+void setGCSoftLimitKB(int32_t kilobytes);
+void setGCCompactPercent(int32_t percent);
+void* gcStatsJSON();
+void* heapProfileText();
+
+#endif
@@ -0,0 +1,142 @@
+
+use strict;
+use warnings;
+
+use FindBin;
+use Getopt::Long;
+use Time::HiRes qw(time);
+
+# Compares the code generated with and without the peephole optimizer: the
+# number of instructions it emits for each program in the --issuedir
+# directory, and how long the program takes to run, best of --runs runs
+
+my $compiler_exe = "compiler";
+my $issueDir = "examples";
+my $runs = 5;
+
+GetOptions (
+    "compiler=s" => \$compiler_exe,
+    "issuedir=s" => \$issueDir,
+    "runs=i" => \$runs,
+);
+
+my $scriptDir = "$FindBin::Bin";
+my $binDir = "$scriptDir/..";
+my $compiler = "$scriptDir/../$compiler_exe";
+my $benchDir = "$binDir/$issueDir/";
+
+chdir($binDir);
+
+unless (-x $compiler) {
+    die "'$compiler' does not exist.\n";
+}
+
+opendir(DIR, "$benchDir");
+my @files = sort grep {
+    $_ =~ /^.+\.mlo$/
+} readdir(DIR);
+closedir(DIR);
+
+sub directives {
+    my ($file) = @_;
+    open(my $fh, "<", "$benchDir$file") or die "Could not open $file\n";
+    my $directives = {};
+    while (my $line = <$fh>) {
+        if ($line =~ m|//\s*INPUT:\s*"(.*)"\s*$|) {
+            $directives->{'INPUT'} = $1;
+        }
+        elsif ($line =~ m|//\s*ARGUMENTS:\s*(.*)$|) {
+            $directives->{'ARGUMENTS'} = $1;
+        }
+        elsif ($line =~ m|//\s*COMPILE_OPTIONS:\s*(.*)$|) {
+            $directives->{'COMPILE_OPTIONS'} = join " ", map {
+                "--$_"
+            } (split /\s+/, $1);
+        }
+    }
+    close($fh);
+    return $directives;
+}
+
+# The lines of the generated assembly that are instructions, rather than
+# labels, directives, data, or comments
+sub countInstructions {
+    my ($asmFile) = @_;
+    open(my $fh, "<", $asmFile) or return 0;
+    my $count = 0;
+    my $inText = 1;
+    while (my $line = <$fh>) {
+        $line =~ s/;.*$//;
+        if ($line =~ /^\s*SECTION\s+\.(\w+)/i) {
+            $inText = $1 eq "text";
+            next;
+        }
+        next unless $inText;
+        next if $line =~ /^\S.*:\s*$/;
+        next if $line =~ /^\s*$/;
+        next if $line =~ /^\s*(global|extern|align)\b/;
+        $count++;
+    }
+    close($fh);
+    return $count;
+}
+
+sub bestRuntime {
+    my ($exe, $directives) = @_;
+    my $input = exists $directives->{'INPUT'}
+              ? " printf '$directives->{'INPUT'}' | "
+              : "";
+    my $args = $directives->{'ARGUMENTS'} // "";
+    my $best;
+    for (1..$runs) {
+        my $start = time;
+        system("$input ./$exe $args >/dev/null 2>&1");
+        my $elapsed = time - $start;
+        $best = $elapsed if !defined $best || $elapsed < $best;
+    }
+    return $best;
+}
+
+my ($totalBefore, $totalAfter, $timeBefore, $timeAfter) = (0, 0, 0, 0);
+
+printf "%-24s %10s %10s %8s %10s %10s\n",
+    "program", "instrs", "peephole", "saved", "time (s)", "peephole";
+foreach my $file (@files) {
+    my $directives = directives($file);
+    my $options = $directives->{'COMPILE_OPTIONS'} // "";
+    my %results;
+    foreach my $variant ("off", "on") {
+        my $flags = $variant eq "off" ? "--no-peephole $options" : $options;
+        my $asmFile = "BENCH_$variant.asm";
+        my $exe = "BENCH_$variant";
+        if (system("$compiler $flags $benchDir$file -S --o $asmFile"
+                 . " >/dev/null 2>&1") != 0
+            || system("$compiler $flags $benchDir$file --o $exe"
+                    . " >/dev/null 2>&1") != 0
+        ) {
+            last;
+        }
+        $results{$variant} = {
+            'instrs' => countInstructions($asmFile),
+            'time' => bestRuntime($exe, $directives),
+        };
+        unlink($asmFile, $exe);
+    }
+    unless (exists $results{'off'} && exists $results{'on'}) {
+        printf "%-24s %s\n", $file, "did not compile";
+        next;
+    }
+    my ($off, $on) = ($results{'off'}, $results{'on'});
+    printf "%-24s %10d %10d %7.1f%% %10.4f %10.4f\n",
+        $file, $off->{'instrs'}, $on->{'instrs'},
+        100 * ($off->{'instrs'} - $on->{'instrs'}) / ($off->{'instrs'} || 1),
+        $off->{'time'}, $on->{'time'};
+    $totalBefore += $off->{'instrs'};
+    $totalAfter += $on->{'instrs'};
+    $timeBefore += $off->{'time'};
+    $timeAfter += $on->{'time'};
+}
+printf "%-24s %10d %10d %7.1f%% %10.4f %10.4f\n",
+    "total", $totalBefore, $totalAfter,
+    100 * ($totalBefore - $totalAfter) / ($totalBefore || 1),
+    $timeBefore, $timeAfter;